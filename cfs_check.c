@@ -0,0 +1,848 @@
+#ifndef MACOSX
+#ifndef LINUX
+#define LINUX
+#endif
+#endif
+
+#define FUSE_USE_VERSION 26
+#ifdef LINUX
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#ifdef LINUX
+#include <sched.h>
+#endif
+
+#include "cpe453fs.h"
+
+#ifndef BLOCKSHIFT
+#define BLOCKSHIFT 12
+#endif
+#define BLOCKSIZE (1<<BLOCKSHIFT)
+
+//the file gets data in its first block and again this many blocks on, with a hole between
+#define HOLEBLOCKS 12
+#define TAILLEN 29
+
+//big enough that a leak can't hide in the free blocks the image starts with
+#define ORPHANBYTES (1<<20)
+
+//a session that ends the way a power cut would, without unmounting
+#define CRASH 1
+
+//the scratch image every session mounts
+static const char *image;
+
+//there is no FUSE session, new files belong to whoever runs the check
+struct fuse_context *fuse_get_context(void)
+{
+	static struct fuse_context ctx;
+
+	ctx.uid = getuid();
+	ctx.gid = getgid();
+	return &ctx;
+}
+
+//picks the checked file out of the root directory
+static void findFile(void *buf, const char *name, uint32_t block_num)
+{
+	if (0 == strcmp(name, "sparse"))
+		*(uint32_t*)buf = block_num;
+}
+
+/*
+	reads size bytes at offset and compares them with what the file should
+	hold. returns the number of reads that differed, 0 or 1
+*/
+static int readBack(struct cpe453fs_ops *fs_ops, uint32_t file, const char *want, off_t fileSize, off_t offset, size_t size)
+{
+	static char got[2*BLOCKSIZE];
+	size_t expect = offset < fileSize ? (size_t)(fileSize - offset) : 0;
+	int len;
+
+	if (expect > size)
+		expect = size;
+
+	len = (*fs_ops->read)(fs_ops->arg, file, got, size, offset);
+	if (len != (int)expect || 0 != memcmp(got, want + offset, expect))
+	{
+		fprintf(stderr, "read of %zu bytes at %ld returned %d bytes that differ\n", size, (long)offset, len);
+		return 1;
+	}
+	return 0;
+}
+
+//fills a file's worth of bytes that tell one file and offset from another
+static void pattern(char *buf, size_t size, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = 'a' + (i / 7 + seed) % 26;
+}
+
+/*
+	checks that name in dir holds size bytes of the given pattern. returns
+	1 and says why if it doesn't
+*/
+static int holds(struct cpe453fs_ops *fs_ops, uint32_t dir, const char *name, size_t size, int seed)
+{
+	char *want = malloc(size + 1);
+	char *got = malloc(size + 1);
+	uint32_t file = (*fs_ops->lookup)(fs_ops->arg, dir, name);
+	struct stat st;
+	int bad = 0;
+
+	pattern(want, size, seed);
+	if (0 == file || 0 != (*fs_ops->getattr)(fs_ops->arg, file, &st))
+	{
+		fprintf(stderr, "%s is missing\n", name);
+		bad = 1;
+	}
+	else if ((size_t)st.st_size != size || (*fs_ops->read)(fs_ops->arg, file, got, size + 1, 0) != (int)size || 0 != memcmp(got, want, size))
+	{
+		fprintf(stderr, "%s does not read back the %zu bytes written\n", name, size);
+		bad = 1;
+	}
+	free(want);
+	free(got);
+	return bad;
+}
+
+//creates name in dir holding size bytes of the given pattern, returns its block or 0
+static uint32_t writeFile(struct cpe453fs_ops *fs_ops, uint32_t dir, const char *name, size_t size, int seed)
+{
+	char *buf = malloc(size + 1);
+	uint32_t file;
+
+	pattern(buf, size, seed);
+	if (0 != (*fs_ops->mknod)(fs_ops->arg, dir, name, S_IFREG | 0644, 0)
+		|| 0 == (file = (*fs_ops->lookup)(fs_ops->arg, dir, name))
+		|| (size > 0 && (*fs_ops->write)(fs_ops->arg, file, buf, size, 0) != (int)size))
+	{
+		fprintf(stderr, "failed to write %s\n", name);
+		file = 0;
+	}
+	free(buf);
+	return file;
+}
+
+/*
+	mounts the image with opts in a child process of its own, so every
+	mount starts from a fresh library, and runs check on it. the child
+	unmounts afterwards unless told to CRASH. returns the number of checks
+	that failed, a child that died counts as one
+*/
+static int session(const char *opts[], int (*check)(struct cpe453fs_ops*, uint32_t), int crash)
+{
+	struct cpe453fs_ops *fs_ops;
+	pid_t child;
+	int flags = O_RDWR;
+	int status;
+	int bad;
+	int fd;
+
+	fflush(NULL);
+	if ((child = fork()) < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (0 == child)
+	{
+#ifdef LINUX
+		/*
+			a crash session keeps to one cpu without wakeup preemption, so the
+			background threads an operation wakes only run once the check
+			stops, and the crash finds their work still to be done
+		*/
+		if (crash)
+		{
+			struct sched_param param = {0};
+			cpu_set_t one;
+
+			CPU_ZERO(&one);
+			CPU_SET(sched_getcpu(), &one);
+			sched_setaffinity(0, sizeof(one), &one);
+			sched_setscheduler(0, SCHED_BATCH, &param);
+		}
+#endif
+		fs_ops = CPE453_get_operations();
+		for (; NULL != opts && NULL != *opts; opts++)
+		{
+			//a snapshot is mounted from an image opened read only, as a user would
+			if (0 == strncmp(*opts, "cfs_snapview=", 13))
+				flags = O_RDONLY;
+
+			//and a replica is made by the first stream it takes
+			if (0 == strncmp(*opts, "cfs_receive=", 12))
+				flags = O_RDWR | O_CREAT;
+			if (0 != (*fs_ops->mount_option)(fs_ops->arg, *opts))
+			{
+				fprintf(stderr, "option %s refused\n", *opts);
+				_exit(1);
+			}
+		}
+		if ((fd = open(image, flags, 0644)) < 0)
+		{
+			perror("Error opening filesystem file");
+			_exit(1);
+		}
+		(*fs_ops->set_file_descriptor)(fs_ops->arg, fd);
+		(*fs_ops->init)();
+
+		bad = (*check)(fs_ops, (*fs_ops->root_node)(fs_ops->arg));
+
+		if (!crash && NULL != fs_ops->destroy)
+			(*fs_ops->destroy)();
+		fflush(NULL);
+		_exit(bad < 100 ? bad : 100);
+	}
+
+	//the library exits with -1 on errors it can't return
+	if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) > 100)
+	{
+		fprintf(stderr, "check session died\n");
+		return 1;
+	}
+	return WEXITSTATUS(status);
+}
+
+/*
+	reads back a file with a hole several extents long, starting inside the
+	hole, across its end and just past it
+*/
+static int checkSparse(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	off_t tail = (off_t)HOLEBLOCKS*BLOCKSIZE + 1234;
+	off_t fileSize = tail + TAILLEN;
+	char *want;
+	uint32_t file = 0;
+	off_t offset;
+	int bad = 0;
+
+	if (0 != (*fs_ops->mknod)(fs_ops->arg, root, "sparse", S_IFREG | 0644, 0)
+		|| 0 != (*fs_ops->readdir)(fs_ops->arg, root, &file, findFile) || 0 == file)
+	{
+		fprintf(stderr, "failed to create the file to check\n");
+		return 1;
+	}
+
+	want = calloc(1, fileSize);
+	memset(want, 'h', 100);
+	memset(want + tail, 't', TAILLEN);
+	(*fs_ops->write)(fs_ops->arg, file, want, 100, 0);
+	(*fs_ops->write)(fs_ops->arg, file, want + tail, TAILLEN, tail);
+
+	//odd steps start reads at every position within the extents the hole covers
+	for (offset = 0; offset < fileSize; offset += 997)
+		bad += readBack(fs_ops, file, want, fileSize, offset, BLOCKSIZE + 500);
+	bad += readBack(fs_ops, file, want, fileSize, tail - 1, TAILLEN + 1);
+	bad += readBack(fs_ops, file, want, fileSize, tail, TAILLEN);
+	bad += readBack(fs_ops, file, want, fileSize, tail + TAILLEN - 1, 10);
+
+	free(want);
+	return bad;
+}
+
+//a file synced before the crash, its directory entry and inode only reach home through replay
+static int writeJournaled(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t file = writeFile(fs_ops, root, "journaled", 3*BLOCKSIZE + 17, 45);
+
+	if (0 == file || 0 != (*fs_ops->fsync)(fs_ops->arg, file, 0))
+	{
+		fprintf(stderr, "failed to sync the journaled file\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int checkJournaled(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return holds(fs_ops, root, "journaled", 3*BLOCKSIZE + 17, 45);
+}
+
+//the image is trimmed to its last used block at unmount, its checkpoint dropped at mount
+static off_t imageSize(void)
+{
+	struct stat st;
+
+	return 0 == stat(image, &st) ? st.st_size : -1;
+}
+
+static int writeOrphan(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return 0 == writeFile(fs_ops, root, "orphan", ORPHANBYTES, 29);
+}
+
+//unlinked and then a crash, before the reclaim thread gets to it
+static int dropOrphan(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return 0 != (*fs_ops->unlink)(fs_ops->arg, root, "orphan");
+}
+
+static int nothing(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return 0;
+}
+
+//the orphan's blocks are back on the free lists, so the same file again fits without growing the image
+static int reuseOrphan(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	off_t before = imageSize();
+	int bad = writeOrphan(fs_ops, root);
+
+	if (imageSize() - before >= ORPHANBYTES/2)
+	{
+		fprintf(stderr, "image grew by %ld bytes, the orphan's blocks were not reclaimed\n", (long)(imageSize() - before));
+		bad++;
+	}
+	return bad;
+}
+
+//what the snapshot keeps, changed in place after it was taken
+#define SNAPBYTES (2*BLOCKSIZE + 100)
+
+static int writeSnapped(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return 0 == writeFile(fs_ops, root, "snapped", SNAPBYTES, 48);
+}
+
+//the first write after the snapshot copies the shared blocks, the live file changes alone
+static int changeSnapped(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t file = (*fs_ops->lookup)(fs_ops->arg, root, "snapped");
+	char buf[SNAPBYTES];
+
+	pattern(buf, SNAPBYTES, 49);
+	if (0 == file || (*fs_ops->write)(fs_ops->arg, file, buf, SNAPBYTES, 0) != SNAPBYTES)
+	{
+		fprintf(stderr, "failed to change snapped\n");
+		return 1;
+	}
+	return 0 == writeFile(fs_ops, root, "unsnapped", 10, 50);
+}
+
+static int checkLive(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return holds(fs_ops, root, "snapped", SNAPBYTES, 49) + holds(fs_ops, root, "unsnapped", 10, 50);
+}
+
+//the snapshot still reads as it was taken and refuses changes
+static int checkSnapshot(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t file = (*fs_ops->lookup)(fs_ops->arg, root, "snapped");
+	int bad = holds(fs_ops, root, "snapped", SNAPBYTES, 48);
+
+	if (0 != (*fs_ops->lookup)(fs_ops->arg, root, "unsnapped"))
+	{
+		fprintf(stderr, "a file made after the snapshot is in it\n");
+		bad++;
+	}
+	if (-EROFS != (*fs_ops->mkdir)(fs_ops->arg, root, "refused", 0755)
+		|| (0 != file && -EROFS != (*fs_ops->write)(fs_ops->arg, file, "x", 1, 0)))
+	{
+		fprintf(stderr, "the snapshot took a change\n");
+		bad++;
+	}
+	return bad;
+}
+
+static int writeSent(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return 0 == writeFile(fs_ops, root, "sent", 5*BLOCKSIZE, 51);
+}
+
+//changes part of what was sent and adds a file, only those blocks go in the next stream
+static int changeSent(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t file = (*fs_ops->lookup)(fs_ops->arg, root, "sent");
+	char buf[BLOCKSIZE];
+
+	pattern(buf, BLOCKSIZE, 52);
+	if (0 == file || (*fs_ops->write)(fs_ops->arg, file, buf, BLOCKSIZE, 2*BLOCKSIZE) != BLOCKSIZE)
+	{
+		fprintf(stderr, "failed to change sent\n");
+		return 1;
+	}
+	return 0 == writeFile(fs_ops, root, "resent", 100, 53);
+}
+
+static int checkSent(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return holds(fs_ops, root, "sent", 5*BLOCKSIZE, 51) + checkLive(fs_ops, root);
+}
+
+static int checkResent(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t file = (*fs_ops->lookup)(fs_ops->arg, root, "sent");
+	char want[5*BLOCKSIZE];
+	int bad = 0;
+
+	pattern(want, sizeof(want), 51);
+	pattern(want + 2*BLOCKSIZE, BLOCKSIZE, 52);
+	if (0 == file)
+	{
+		fprintf(stderr, "sent is missing\n");
+		return 1;
+	}
+	bad += readBack(fs_ops, file, want, sizeof(want), 0, BLOCKSIZE + 500);
+	bad += readBack(fs_ops, file, want, sizeof(want), 2*BLOCKSIZE - 7, BLOCKSIZE + 14);
+	bad += readBack(fs_ops, file, want, sizeof(want), 4*BLOCKSIZE, BLOCKSIZE);
+	return bad + holds(fs_ops, root, "resent", 100, 53) + checkLive(fs_ops, root);
+}
+
+//tiny files share pack blocks, every few outgrow their slot or go again
+#define TINYFILES 40
+#define TINYSIZE(i) ((i)*7 % 60 + 1)
+#define GROWN(i) ((i) % 5 == 2)
+#define GONE(i) ((i) % 7 == 3)
+#define GROWNSIZE (BLOCKSIZE + 300)
+
+static int writeTiny(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	char name[32];
+	char buf[GROWNSIZE];
+	uint32_t dir;
+	uint32_t file;
+	int bad = 0;
+	int i;
+
+	if (0 != (*fs_ops->mkdir)(fs_ops->arg, root, "tiny", 0755) || 0 == (dir = (*fs_ops->lookup)(fs_ops->arg, root, "tiny")))
+	{
+		fprintf(stderr, "failed to make tiny\n");
+		return 1;
+	}
+	for (i = 0; i < TINYFILES; i++)
+	{
+		snprintf(name, sizeof(name), "t%d", i);
+		bad += 0 == writeFile(fs_ops, dir, name, TINYSIZE(i), i);
+	}
+
+	//a second name for a file that then grows through it, the first name has to follow
+	if (0 == (file = (*fs_ops->lookup)(fs_ops->arg, dir, "t2")) || 0 != (*fs_ops->link)(fs_ops->arg, dir, "linked", file))
+	{
+		fprintf(stderr, "failed to link t2\n");
+		bad++;
+	}
+	for (i = 0; i < TINYFILES; i++)
+	{
+		snprintf(name, sizeof(name), 2 == i ? "linked" : "t%d", i);
+		pattern(buf, GROWNSIZE, i + 100);
+		if (GROWN(i) && (0 == (file = (*fs_ops->lookup)(fs_ops->arg, dir, name))
+			|| (*fs_ops->write)(fs_ops->arg, file, buf, GROWNSIZE, 0) != GROWNSIZE))
+		{
+			fprintf(stderr, "failed to grow %s\n", name);
+			bad++;
+		}
+		snprintf(name, sizeof(name), "t%d", i);
+		if (GONE(i) && 0 != (*fs_ops->unlink)(fs_ops->arg, dir, name))
+		{
+			fprintf(stderr, "failed to unlink %s\n", name);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+static int checkTiny(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t dir = (*fs_ops->lookup)(fs_ops->arg, root, "tiny");
+	char name[32];
+	int bad = 0;
+	int i;
+
+	for (i = 0; i < TINYFILES; i++)
+	{
+		snprintf(name, sizeof(name), "t%d", i);
+		if (GONE(i) && 0 != (*fs_ops->lookup)(fs_ops->arg, dir, name))
+		{
+			fprintf(stderr, "%s is still there\n", name);
+			bad++;
+		}
+		else if (!GONE(i))
+			bad += holds(fs_ops, dir, name, GROWN(i) ? GROWNSIZE : TINYSIZE(i), GROWN(i) ? i + 100 : i);
+	}
+	return bad + holds(fs_ops, dir, "linked", GROWNSIZE, 102);
+}
+
+//enough entries of one length to fill several directory blocks
+#define ENTRIES 300
+#define ENTRYNAME "%c%03d-entry-name-long-enough-to-fill-blocks"
+
+//blocks held by the entry named name in dir, or -1
+static long blocksOf(struct cpe453fs_ops *fs_ops, uint32_t dir, const char *name)
+{
+	uint32_t file = (*fs_ops->lookup)(fs_ops->arg, dir, name);
+	struct stat st;
+
+	return 0 != file && 0 == (*fs_ops->getattr)(fs_ops->arg, file, &st) ? (long)st.st_blocks : -1;
+}
+
+/*
+	makes count entries named after the letter in dir, every step-th from
+	first on. returns the number that failed
+*/
+static int makeEntries(struct cpe453fs_ops *fs_ops, uint32_t dir, char letter, int first, int step, int count)
+{
+	char name[64];
+	int bad = 0;
+	int i;
+
+	for (i = first; i < count; i += step)
+	{
+		snprintf(name, sizeof(name), ENTRYNAME, letter, i);
+		if (0 != (*fs_ops->mknod)(fs_ops->arg, dir, name, S_IFREG | 0644, 0))
+		{
+			fprintf(stderr, "failed to make %s\n", name);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+//checks which of the entries named after the letter dir holds, every step-th from first on
+static int findEntries(struct cpe453fs_ops *fs_ops, uint32_t dir, char letter, int first, int step, int count)
+{
+	char name[64];
+	int bad = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		snprintf(name, sizeof(name), ENTRYNAME, letter, i);
+		if ((i >= first && 0 == (i - first) % step) != (0 != (*fs_ops->lookup)(fs_ops->arg, dir, name)))
+		{
+			fprintf(stderr, "%s is %s\n", name, i >= first && 0 == (i - first) % step ? "missing" : "still there");
+			bad++;
+		}
+	}
+	return bad;
+}
+
+static int writeTombs(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t dir;
+	char name[64];
+	long blocks;
+	int bad = 0;
+	int i;
+
+	if (0 != (*fs_ops->mkdir)(fs_ops->arg, root, "tombs", 0755) || 0 == (dir = (*fs_ops->lookup)(fs_ops->arg, root, "tombs")))
+	{
+		fprintf(stderr, "failed to make tombs\n");
+		return 1;
+	}
+	bad += makeEntries(fs_ops, dir, 'a', 0, 1, ENTRIES);
+	blocks = blocksOf(fs_ops, root, "tombs");
+
+	for (i = 1; i < ENTRIES; i += 2)
+	{
+		snprintf(name, sizeof(name), ENTRYNAME, 'a', i);
+		if (0 != (*fs_ops->unlink)(fs_ops->arg, dir, name))
+		{
+			fprintf(stderr, "failed to unlink %s\n", name);
+			bad++;
+		}
+	}
+
+	//as many entries of the same length fit where the removed ones were
+	bad += makeEntries(fs_ops, dir, 'b', 1, 2, ENTRIES);
+	if (blocksOf(fs_ops, root, "tombs") > blocks)
+	{
+		fprintf(stderr, "tombs grew from %ld to %ld blocks, removed entries were not reused\n", blocks, blocksOf(fs_ops, root, "tombs"));
+		bad++;
+	}
+	return bad;
+}
+
+static int checkTombs(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t dir = (*fs_ops->lookup)(fs_ops->arg, root, "tombs");
+
+	return findEntries(fs_ops, dir, 'a', 0, 2, ENTRIES) + findEntries(fs_ops, dir, 'b', 1, 2, ENTRIES);
+}
+
+//directories whose inserts go through the hint table side by side with the checked one
+#define SIDEDIRS 7
+
+static int writeHinted(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	char name[32];
+	int bad = 0;
+	int i;
+
+	for (i = 0; i < SIDEDIRS; i++)
+	{
+		snprintf(name, sizeof(name), "side%d", i);
+		bad += 0 != (*fs_ops->mkdir)(fs_ops->arg, root, name, 0755);
+	}
+	if (0 != (*fs_ops->mkdir)(fs_ops->arg, root, "dense", 0755) || 0 != (*fs_ops->mkdir)(fs_ops->arg, root, "hinted", 0755))
+	{
+		fprintf(stderr, "failed to make dense and hinted\n");
+		return 1;
+	}
+	bad += makeEntries(fs_ops, (*fs_ops->lookup)(fs_ops->arg, root, "dense"), 'c', 0, 1, ENTRIES);
+	return bad + makeEntries(fs_ops, (*fs_ops->lookup)(fs_ops->arg, root, "hinted"), 'c', 0, 2, ENTRIES);
+}
+
+/*
+	the hints are lost at unmount, so the rest of hinted is appended after
+	its last entry is found again, taking turns with the side directories.
+	it has to end up as tightly packed as dense, filled in one go
+*/
+static int appendHinted(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	uint32_t hinted = (*fs_ops->lookup)(fs_ops->arg, root, "hinted");
+	char name[32];
+	int bad = 0;
+	int i;
+
+	for (i = 1; i < ENTRIES; i += 2)
+	{
+		snprintf(name, sizeof(name), "side%d", i % SIDEDIRS);
+		bad += makeEntries(fs_ops, hinted, 'c', i, ENTRIES, i + 1);
+		bad += makeEntries(fs_ops, (*fs_ops->lookup)(fs_ops->arg, root, name), 'c', i, ENTRIES, i + 1);
+	}
+	if (blocksOf(fs_ops, root, "hinted") != blocksOf(fs_ops, root, "dense"))
+	{
+		fprintf(stderr, "hinted has %ld blocks, dense %ld\n", blocksOf(fs_ops, root, "hinted"), blocksOf(fs_ops, root, "dense"));
+		bad++;
+	}
+	return bad;
+}
+
+static int checkHinted(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	char name[32];
+	int bad = 0;
+	int i;
+
+	bad += findEntries(fs_ops, (*fs_ops->lookup)(fs_ops->arg, root, "dense"), 'c', 0, 1, ENTRIES);
+	bad += findEntries(fs_ops, (*fs_ops->lookup)(fs_ops->arg, root, "hinted"), 'c', 0, 1, ENTRIES);
+	for (i = 0; i < SIDEDIRS; i++)
+	{
+		snprintf(name, sizeof(name), "side%d", i);
+		bad += findEntries(fs_ops, (*fs_ops->lookup)(fs_ops->arg, root, name), 'c', i % 2 ? i : i + SIDEDIRS, 2*SIDEDIRS, ENTRIES);
+	}
+	return bad;
+}
+
+//a copy of from named to, made outside any mount
+static int copyImage(const char *from, const char *to)
+{
+	static char buf[64*BLOCKSIZE];
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ssize_t len = 0;
+
+	while (in >= 0 && out >= 0 && (len = read(in, buf, sizeof(buf))) > 0 && write(out, buf, len) == len);
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	if (in < 0 || out < 0 || 0 != len)
+	{
+		fprintf(stderr, "failed to copy %s to %s\n", from, to);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	sends the image to a stream, all of it or what changed since epoch from,
+	and applies the stream to replica. check then runs on a copy of the
+	replica, as mounting the replica itself would change it under the next
+	stream
+*/
+static int sendTo(const char *replica, const char *from, int (*check)(struct cpe453fs_ops*, uint32_t))
+{
+	char stream[PATH_MAX];
+	char view[PATH_MAX];
+	char sendOpt[PATH_MAX + 32];
+	char fromOpt[32];
+	char receiveOpt[PATH_MAX + 32];
+	const char *sending[] = {sendOpt, NULL, NULL};
+	const char *receiving[] = {receiveOpt, NULL};
+	const char *source = image;
+	int bad;
+
+	snprintf(stream, sizeof(stream), "%s.stream", source);
+	snprintf(view, sizeof(view), "%s.view", replica);
+	snprintf(sendOpt, sizeof(sendOpt), "cfs_send=%s", stream);
+	snprintf(receiveOpt, sizeof(receiveOpt), "cfs_receive=%s", stream);
+	if (NULL != from)
+	{
+		snprintf(fromOpt, sizeof(fromOpt), "cfs_sendfrom=%s", from);
+		sending[1] = fromOpt;
+	}
+
+	bad = session(sending, nothing, 0);
+	image = replica;
+	bad += session(receiving, nothing, 0);
+	if (0 == bad && 0 == (bad = copyImage(replica, view)))
+	{
+		image = view;
+		bad += session(NULL, check, 0);
+	}
+	image = source;
+
+	unlink(stream);
+	unlink(view);
+	return bad;
+}
+
+//a file written last, its chain is in the checkpoint along with that of the orphan written early on
+#define WARMBYTES (9*BLOCKSIZE + 5)
+
+static int writeWarm(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return 0 == writeFile(fs_ops, root, "warm", WARMBYTES, 34);
+}
+
+static int checkWarm(struct cpe453fs_ops *fs_ops, uint32_t root)
+{
+	return holds(fs_ops, root, "warm", WARMBYTES, 34) + holds(fs_ops, root, "orphan", ORPHANBYTES, 29) + checkLive(fs_ops, root) + checkTombs(fs_ops, root);
+}
+
+/*
+	zeroes the cache checkpoint a clean unmount left behind the used blocks,
+	a mount that trusted it would find the chains early in the image cut
+	short. a mount that crashes right away shows where the used blocks end,
+	as it cuts the checkpoint off before anything else
+*/
+static int damageCheckpoint(void)
+{
+	char saved[PATH_MAX];
+	char buf[BLOCKSIZE];
+	off_t end = imageSize();
+	off_t at;
+	ssize_t len;
+	int bad;
+	int fd;
+
+	snprintf(saved, sizeof(saved), "%s.saved", image);
+	if (0 != (bad = copyImage(image, saved)))
+		return bad;
+	bad += session(NULL, nothing, CRASH);
+	at = imageSize();
+	bad += copyImage(saved, image);
+	unlink(saved);
+
+	if (0 != bad || at >= end || (fd = open(image, O_RDWR)) < 0)
+	{
+		fprintf(stderr, "no cache checkpoint to damage\n");
+		return 1;
+	}
+	memset(buf, 0, sizeof(buf));
+	for (; at < end; at += len)
+	{
+		len = end - at < (off_t)sizeof(buf) ? end - at : (off_t)sizeof(buf);
+		bad += pwrite(fd, buf, len, at) != len;
+	}
+	close(fd);
+	return bad;
+}
+
+//changes the size of the image behind the library's back
+static int resizeImage(off_t by)
+{
+	if (0 != truncate(image, imageSize() + by))
+	{
+		perror("failed to resize image");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	upgrades a scratch copy of an image and runs the checks against it, each
+	mount in a session of its own
+
+	cfs_check <scratch FS File>
+*/
+int main(int argc, char *argv[])
+{
+	const char *upgrade[] = {"cfs_upgrade", NULL};
+	const char *journaled[] = {"cfs_journal", NULL};
+	const char *snapshot[] = {"cfs_snapshot", NULL};
+	const char *snapview[] = {"cfs_snapview=1", NULL};
+	const char *snapdrop[] = {"cfs_snapdrop=1", NULL};
+	const char *pack[] = {"cfs_pack", NULL};
+	char replica[PATH_MAX];
+	int bad = 0;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s <scratch FS File>\n", argv[0]);
+		exit(1);
+	}
+	image = argv[1];
+
+	bad += session(upgrade, checkSparse, 0);
+
+	//an orphan a crash left listed is freed by the next mount
+	bad += session(upgrade, writeOrphan, 0);
+	bad += session(upgrade, dropOrphan, CRASH);
+	bad += session(upgrade, nothing, 0);
+	bad += session(upgrade, reuseOrphan, 0);
+
+	//a crash after fsync keeps what the journal committed, the journal stays on for every later mount
+	bad += session(journaled, writeJournaled, CRASH);
+	bad += session(journaled, checkJournaled, 0);
+
+	//a snapshot taken at mount keeps what the image held, dropping it leaves the live files alone
+	bad += session(NULL, writeSnapped, 0);
+	bad += session(snapshot, changeSnapped, 0);
+	bad += session(snapview, checkSnapshot, 0);
+	bad += session(NULL, checkLive, 0);
+	bad += session(snapdrop, checkLive, 0);
+	bad += session(NULL, checkLive, 0);
+
+	//tiny files packed together read back as written, also once grown out of their slots
+	bad += session(pack, writeTiny, 0);
+	bad += session(pack, checkTiny, 0);
+	bad += session(NULL, checkTiny, 0);
+
+	//the entries removed from a directory make room for new ones
+	bad += session(NULL, writeTombs, 0);
+	bad += session(NULL, checkTombs, 0);
+
+	//inserts after a remount find the end of a directory again, sharing the hint table
+	bad += session(NULL, writeHinted, 0);
+	bad += session(NULL, appendHinted, 0);
+	bad += session(NULL, checkHinted, 0);
+
+	//a cache checkpoint that is damaged, or left behind by an image grown or cut since, is not used
+	bad += session(NULL, writeWarm, 0);
+	bad += damageCheckpoint();
+	bad += session(NULL, checkWarm, 0);
+	bad += resizeImage(BLOCKSIZE);
+	bad += session(NULL, checkWarm, 0);
+	bad += resizeImage(-1);
+	bad += session(NULL, checkWarm, 0);
+
+	//a full send and then one of what changed since bring a replica up to date
+	snprintf(replica, sizeof(replica), "%s.replica", image);
+	unlink(replica);
+	bad += session(NULL, writeSent, 0);
+	bad += sendTo(replica, NULL, checkSent);
+	bad += session(NULL, changeSent, 0);
+	bad += sendTo(replica, "1", checkResent);
+	unlink(replica);
+
+	printf("%d bad checks\n", bad);
+	return bad != 0;
+}
@@ -0,0 +1,71 @@
+#ifndef MACOSX
+#ifndef LINUX
+#define LINUX
+#endif
+#endif
+
+#define FUSE_USE_VERSION 26
+#ifdef LINUX
+#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+#include "cpe453fs.h"
+
+/*
+	sends an image, or what changed in it since an earlier send, to a
+	stream and applies such a stream to a replica. the image must not be
+	mounted meanwhile
+
+	cfs_stream send <FS File> <stream> [epoch]
+	cfs_stream receive <FS File> <stream>
+*/
+int main(int argc, char *argv[])
+{
+	struct cpe453fs_ops *fs_ops = CPE453_get_operations();
+	char opt[PATH_MAX + 32];
+	int send;
+	int fd;
+
+	if (argc < 4 || (0 != strcmp(argv[1], "send") && 0 != strcmp(argv[1], "receive")))
+	{
+		fprintf(stderr, "Usage: %s send <FS File> <stream> [epoch]\n", argv[0]);
+		fprintf(stderr, "       %s receive <FS File> <stream>\n", argv[0]);
+		exit(1);
+	}
+	send = 0 == strcmp(argv[1], "send");
+
+	fd = open(argv[2], send ? O_RDWR : O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		perror("Error opening filesystem file");
+		exit(1);
+	}
+
+	snprintf(opt, sizeof(opt), "%s=%s", send ? "cfs_send" : "cfs_receive", argv[3]);
+	if (0 != (*fs_ops->mount_option)(fs_ops->arg, opt))
+	{
+		fprintf(stderr, "File system does not take %s\n", opt);
+		exit(1);
+	}
+	if (send && argc > 4)
+	{
+		snprintf(opt, sizeof(opt), "cfs_sendfrom=%s", argv[4]);
+		(*fs_ops->mount_option)(fs_ops->arg, opt);
+	}
+
+	(*fs_ops->set_file_descriptor)(fs_ops->arg, fd);
+	(*fs_ops->init)();
+	(*fs_ops->destroy)();
+
+	close(fd);
+	return 0;
+}
@@ -41,11 +41,18 @@ struct cpe453fs_ops
 	// a read-only file system
 	int (*getattr)(void*, uint32_t block_num, struct stat *stbuf);
 	int (*readdir)(void*, uint32_t block_num, void *buf, CPE453_readdir_callback_t cb);
+	// Optional.  Returns the block number of name in the directory at
+	// block_num, or 0 if there is no such entry.  Path lookups fall back to
+	// readdir without it.
+	uint32_t (*lookup)(void*, uint32_t block_num, const char *name);
 	int (*open)(void*, uint32_t block_num);
 	int (*read)(void*, uint32_t block_num, char *buff, size_t size, off_t offset);
 	int (*readlink)(void*, uint32_t block_num, char *buff, size_t buff_size);
 	uint32_t (*root_node)(void*);
 	void (*set_file_descriptor)(void*, int);
+	// Called for each "-o cfs_..." mount option before the file descriptor is
+	// set.  Returns 0 if the option was understood.
+	int (*mount_option)(void*, const char *opt);
 
 	// Functions necessary for a read-write file system.  I suggest implementing
 	// them in the order found in this header file.
@@ -68,6 +75,24 @@ struct cpe453fs_ops
 	void (*init)(void);
 	// Called when the file system is unmounted, but before the program exits
 	void (*destroy)(void);
+	// Reserves space for [offset, offset+len) without writing data.  mode takes
+	// the fallocate(2) flags, only FALLOC_FL_KEEP_SIZE is supported.
+	int (*fallocate)(void*, uint32_t block_num, int mode, off_t offset, off_t len);
+	// Returns the next SEEK_DATA or SEEK_HOLE boundary at or after offset.
+	// libfuse 2.x has no lseek callback, so the bridge never calls this.
+	off_t (*lseek)(void*, uint32_t block_num, off_t offset, int whence);
+	// Makes what has been written durable.  Used for both fsync and fsyncdir,
+	// datasync is set when only the data and size need to be.
+	int (*fsync)(void*, uint32_t block_num, int datasync);
+	// Called on each close of a file descriptor, before release, with the block
+	// open was called with.
+	int (*flush)(void*, uint32_t block_num);
+	// Copies len bytes from one file to another, or within one, without the
+	// data leaving the file system.  flags must be 0.  Returns the bytes copied.
+	ssize_t (*copy_file_range)(void*, uint32_t src_block, off_t src_offset, uint32_t dst_block, off_t dst_offset, size_t len, int flags);
+	// Writes the file system's counters into buff as text.  Returns the length
+	// snprintf would have produced.
+	int (*stats)(void*, char *buff, size_t size);
 };
 
 extern struct cpe453fs_ops *CPE453_get_operations(void);
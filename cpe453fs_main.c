@@ -102,7 +102,10 @@ static int lookup_block_num(const char *str, uint32_t *num, const char **rem, ui
 		args.name[ last - curr ] = 0;
 		memcpy(args.name, curr, last - curr);
 		args.block = 0;
-		(*fs_ops->readdir)(fs_ops->arg, curr_block, (void*)&args, lookup_readdir_cb);
+		if (NULL != fs_ops->lookup)
+			args.block = (*fs_ops->lookup)(fs_ops->arg, curr_block, args.name);
+		else
+			(*fs_ops->readdir)(fs_ops->arg, curr_block, (void*)&args, lookup_readdir_cb);
 
 		if (0 == args.block)
 			return -ENOENT;
@@ -203,6 +206,9 @@ static int cpe453fs_open(const char *path, struct fuse_file_info *fi)
 	}
 	res = (*fs_ops->open)(fs_ops->arg, bn);
 
+	// flush runs on every close, it takes the block from here instead of looking the path up again
+	fi->fh = bn;
+
     return res;
 }
 
@@ -551,6 +557,123 @@ off_t offset, struct fuse_file_info *unused)
     return res;
 }
 
+#if FUSE_VERSION >= 29
+static int cpe453fs_fallocate(const char *path, int mode, off_t offset,
+off_t len, struct fuse_file_info *unused)
+{
+    int res = 0;
+	uint32_t bn;
+
+	if (NULL == fs_ops->fallocate)
+		return -EACCES;
+
+	res = lookup_block_num(path, &bn, NULL, NULL);
+	if (res < 0)
+		return res;
+#ifdef DEBUG
+	printf("FALLOCATE %s (%u)\n", path, bn);
+#endif
+
+	res = (*fs_ops->fallocate)(fs_ops->arg, bn, mode, offset, len);
+
+    return res;
+}
+#endif
+
+/*
+ * dead code with the libfuse 2.x this file builds against: FUSE_VERSION
+ * stops short of 34 there and 2.x has no copy_file_range to hook, so the
+ * kernel falls back to reads and writes. it only comes alive once the
+ * file moves to the libfuse 3 API; until then mycopy is reached only by
+ * callers of the ops table
+ */
+#if FUSE_VERSION >= 34
+static ssize_t cpe453fs_copy_file_range(const char *path_in,
+struct fuse_file_info *fi_in, off_t offset_in, const char *path_out,
+struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags)
+{
+    ssize_t res = 0;
+	uint32_t bn_in;
+	uint32_t bn_out;
+
+	if (NULL == fs_ops->copy_file_range)
+		return -EOPNOTSUPP;
+
+	res = lookup_block_num(path_in, &bn_in, NULL, NULL);
+	if (res < 0)
+		return res;
+	res = lookup_block_num(path_out, &bn_out, NULL, NULL);
+	if (res < 0)
+		return res;
+#ifdef DEBUG
+	printf("COPY_FILE_RANGE %s (%u) -> %s (%u)\n", path_in, bn_in, path_out, bn_out);
+#endif
+
+	res = (*fs_ops->copy_file_range)(fs_ops->arg, bn_in, offset_in, bn_out, offset_out, size, flags);
+
+    return res;
+}
+#endif
+
+static int cpe453fs_fsync(const char *path, int datasync,
+struct fuse_file_info *unused)
+{
+    int res = 0;
+	uint32_t bn;
+
+	if (NULL == fs_ops->fsync)
+		return 0;
+
+	res = lookup_block_num(path, &bn, NULL, NULL);
+	if (res < 0)
+		return res;
+#ifdef DEBUG
+	printf("FSYNC %s (%u)\n", path, bn);
+#endif
+
+	res = (*fs_ops->fsync)(fs_ops->arg, bn, datasync);
+
+    return res;
+}
+
+static int cpe453fs_fsyncdir(const char *path, int datasync,
+struct fuse_file_info *unused)
+{
+    int res = 0;
+	uint32_t bn;
+
+	if (NULL == fs_ops->fsync)
+		return 0;
+
+	res = lookup_block_num(path, &bn, NULL, NULL);
+	if (res < 0)
+		return res;
+#ifdef DEBUG
+	printf("FSYNCDIR %s (%u)\n", path, bn);
+#endif
+
+	res = (*fs_ops->fsync)(fs_ops->arg, bn, datasync);
+
+    return res;
+}
+
+static int cpe453fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int res = 0;
+	uint32_t bn = fi->fh;
+
+	if (NULL == fs_ops->flush)
+		return 0;
+
+#ifdef DEBUG
+	printf("FLUSH %s (%u)\n", path, bn);
+#endif
+
+	res = (*fs_ops->flush)(fs_ops->arg, bn);
+
+    return res;
+}
+
 static void *cpe453fs_init(struct fuse_conn_info *conn)
 {
 	if (fs_ops->init)
@@ -564,6 +687,19 @@ static void cpe453fs_destroy(void *unused)
 		(*fs_ops->destroy)();
 }
 
+static int opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	if (FUSE_OPT_KEY_OPT != key || 0 != strncmp(arg, "cfs_", 4))
+		return 1;
+
+	if (NULL == fs_ops->mount_option || 0 != (*fs_ops->mount_option)(fs_ops->arg, arg))
+	{
+		fprintf(stderr, "Unknown file system option %s\n", arg);
+		exit(1);
+	}
+	return 0;
+}
+
 static void init_ops(struct fuse_operations *ops)
 {
 	memset(ops, 0, sizeof(*ops));
@@ -602,6 +738,21 @@ static void init_ops(struct fuse_operations *ops)
 		ops->truncate	= cpe453fs_truncate;
 	if (NULL != fs_ops->write)
 		ops->write	= cpe453fs_write;
+#if FUSE_VERSION >= 29
+	if (NULL != fs_ops->fallocate)
+		ops->fallocate	= cpe453fs_fallocate;
+#endif
+	if (NULL != fs_ops->fsync)
+	{
+		ops->fsync		= cpe453fs_fsync;
+		ops->fsyncdir	= cpe453fs_fsyncdir;
+	}
+	if (NULL != fs_ops->flush)
+		ops->flush		= cpe453fs_flush;
+#if FUSE_VERSION >= 34
+	if (NULL != fs_ops->copy_file_range)
+		ops->copy_file_range	= cpe453fs_copy_file_range;
+#endif
 	ops->init = cpe453fs_init;
 	ops->destroy = cpe453fs_destroy;
 }
@@ -610,6 +761,7 @@ int main(int argc, char *argv[])
 {
 	int res;
 	struct fuse_operations cpe453fs_ops;
+	struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv);
 
 	fs_ops = CPE453_get_operations();
 
@@ -621,6 +773,9 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (fuse_opt_parse(&args, NULL, NULL, opt_proc) == -1)
+		exit(1);
+
 	fd = open(argv[argc-1], O_RDWR
 #ifdef LINUX
 //		| O_DIRECT
@@ -643,7 +798,8 @@ int main(int argc, char *argv[])
 	if (NULL != fs_ops->set_file_descriptor)
 		(*fs_ops->set_file_descriptor)(fs_ops->arg, fd);
 
-    res = fuse_main(argc - 1, argv, &cpe453fs_ops, NULL);
+    res = fuse_main(args.argc, args.argv, &cpe453fs_ops, NULL);
+	fuse_opt_free_args(&args);
 
 	close(fd);
 	return res;
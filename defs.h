@@ -18,8 +18,11 @@
 #define SUPERBLOCK 0
 #define INODE 1
 
-#define BLOCKSIZE 4096
-#define INDEX(block) (block*BLOCKSIZE)
+#ifndef BLOCKSHIFT
+#define BLOCKSHIFT 12
+#endif
+#define BLOCKSIZE (1<<BLOCKSHIFT)
+#define INDEX(block) ((block)<<BLOCKSHIFT)
 #define ENDBLOCK(base, offset) ((offset - base) >= (BLOCKSIZE-BNUMSIZE))
 
 
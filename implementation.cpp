@@ -6,9 +6,23 @@
 #include <stdio.h>
 #include <errno.h>
 #include <sys/statvfs.h>
+#include <fcntl.h>
 #include <algorithm>
 #include <fuse.h>
 #include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRSIMD
+#endif
+
+//make ALLOC=debug checks every allocation with smartalloc
+#ifdef SMARTALLOC
+#include "smartalloc.h"
+#endif
 
 #include "cpe453fs.h"
 
@@ -22,9 +36,15 @@
 #define TIMESIZE 4
 #define SIZESIZE 8
 #define ALLBLOCKSSIZE 8
+#define TIMESBYTES (6*TIMESIZE)
+
+//a free chain head is its type code, the next free block and the snapshot generation it was freed in
+#define FREEHEADSIZE (TYPECODESIZE+2*BNUMSIZE)
 #define NEXTEXTENTSIZE 4
 #define DIREXTENTHEADSIZE TYPECODESIZE
 #define FILEEXTENTHEADSIZE (TYPECODESIZE+BNUMSIZE)
+#define HOLESPANSIZE 4
+#define HOLEHEADSIZE (FILEEXTENTHEADSIZE+HOLESPANSIZE)
 #define MINDIRSIZE 7
 
 #define INODESIZE 64
@@ -32,10 +52,21 @@
 #define SUPERBLOCK 0
 #define INODE 1
 
-#define BLOCKSIZE 4096
+//block size is fixed at build time and recorded in the image, 4 KiB to 64 KiB
+#ifndef BLOCKSHIFT
 #define BLOCKSHIFT 12
-#define INDEX(block) (block<<BLOCKSHIFT)
-#define ENDBLOCK(base, offset) ((offset - base) > (BLOCKSIZE-BNUMSIZE-MINDIRSIZE))
+#endif
+#if BLOCKSHIFT < 12 || BLOCKSHIFT > 16
+#error "BLOCKSHIFT must be between 12 and 16"
+#endif
+#define BLOCKSIZE (1<<BLOCKSHIFT)
+#define INDEX(block) ((uint64_t)(block)<<BLOCKSHIFT)
+
+//block numbers stay 32 bits on disk, byte offsets into the image are 64 bits
+#define MAXBLOCKS ((uint64_t)UINT32_MAX)
+
+//images that predate the recorded geometry all have 4 KiB blocks
+#define LEGACYSHIFT 12
 
 
 #define LENSIZE 2
@@ -45,23 +76,202 @@
 #define NLINKDEX 6
 #define UIDDEX 8
 #define GIDDEX 12
+#define FLAGSDEX 20
 #define ATIMESDEX 24
 #define ATIMENSDEX 28
 #define MTIMESDEX 32
 #define MTIMENSDEX 36
+#define STIMESDEX 40
+#define STIMENSDEX 44
 #define SIZEDEX 48
 #define ALLBLOCKSDEX 56
 
+#define SUPER_NUM 1
 #define INODE_NUM 2
 #define DEXTENT_NUM 3
 #define FEXTENT_NUM 4
 #define FREE_NUM 5
+#define FUEXTENT_NUM 6
+#define HEXTENT_NUM 7
+#define ORPHAN_NUM 8
+#define PACK_NUM 9
+#define FORWARD_NUM 10
+#define JOURNAL_NUM 11
+#define SNAP_NUM 12
+#define SNAPMAP_NUM 13
+#define EPOCH_NUM 14
+
+//inode flag bits
+#define UNWRITTENFLAG 0x1
+#define HOLEFLAG 0x2
+#define SPARSEFLAGS (UNWRITTENFLAG|HOLEFLAG)
+
+//images that opt in to format extensions keep a header in the superblock filler
+#define EXTDEX 4
+#define EXTMAGIC 0x58534643
+
+//extension feature bits
+#define UNWRITTENFEATURE 0x1
+#define HOLEFEATURE 0x2
+#define FREECHAINFEATURE 0x4
+#define ORPHANFEATURE 0x8
+#define AGFEATURE 0x10
+#define CKPTFEATURE 0x20
+#define TOMBFEATURE 0x40
+#define GEOMFEATURE 0x100
+#define ALLFEATURES (UNWRITTENFEATURE|HOLEFEATURE|FREECHAINFEATURE|ORPHANFEATURE|AGFEATURE|CKPTFEATURE|TOMBFEATURE|GEOMFEATURE)
+
+//packing small inodes is a format change of its own, only turned on by cfs_pack
+#define PACKFEATURE 0x80
+
+//so is the metadata journal, turned on by cfs_journal
+#define JOURNALFEATURE 0x200
+
+//and the snapshot table, made by the first cfs_snapshot
+#define SNAPFEATURE 0x400
+
+//and the block epochs incremental sends go by, turned on by cfs_track or the first send
+#define SENDFEATURE 0x800
+
+//start, length and checksum of the cache checkpoint
+#define CKPTFIELDS (BNUMSIZE+BNUMSIZE+SIZESIZE)
+
+//seconds between reclaim passes when nothing wakes the reclaim thread
+#define RECLAIMPERIOD 5
+
+//the image grows by this many blocks whenever the free list runs dry (64 MiB)
+#define GROWCHUNK ((64<<20)>>BLOCKSHIFT)
+
+//allocation groups are one growth chunk each, groups past the last share heads
+#define AGBLOCKS GROWCHUNK
+#define AGMAX 512
+
+/*
+	the journal is a region of the image, 8 MiB, bracketed by a head block and
+	a trailer block. records in between hold the blocks changed by a batch of
+	operations. at most JDIRTYMAX blocks wait for a commit, an operation
+	that needs more commits and checkpoints in the middle
+*/
+#define JOURNALBLOCKS ((8<<20)>>BLOCKSHIFT)
+#define JRECMAGIC 0x4c4e524a
+#define JDESC ((BLOCKSIZE-sizeof(jrecHead))/BNUMSIZE)
+#define JDIRTYMAX ((JOURNALBLOCKS-2)/4)
+#define JMAXREC (JDIRTYMAX+(JDIRTYMAX+JDESC-1)/JDESC)
+#define JENTRIES (2*JOURNALBLOCKS)
+
+//seconds between commits when nothing asks for one sooner
+#define COMMITPERIOD 5
+
+/*
+	how fsync is honored, picked with cfs_sync=. strict syncs the image for
+	every call, batch lets calls within a window share one sync, fast
+	returns at once and leaves it to the commit thread or the system
+*/
+#define SYNCSTRICT 0
+#define SYNCBATCH 1
+#define SYNCFAST 2
+
+//microseconds a batched fsync waits for others to join it
+#define SYNCWINDOW 2000
+
+//batched rounds whose results are kept for their callers
+#define SYNCROUNDS 16
+
+//snapshots kept at once, and block to copy pairs in a map block
+#define SNAPMAX 64
+#define MAPPAIRS ((BLOCKSIZE-sizeof(snapMapHead)-BNUMSIZE)/(2*BNUMSIZE))
+
+//block epochs in an epoch table block, which is chained through its last word
+#define EPOCHSPAN ((BLOCKSIZE-TYPECODESIZE-BNUMSIZE)/BNUMSIZE)
+
+//entries written at once when marking
+#define EPOCHRUN 64
+
+//send streams start with their own magic and end their blocks with an out of range number
+#define STREAMMAGIC 0x4d525453
+#define STREAMEND 0xffffffff
+
+//inodes whose timestamps can wait in memory, and seconds they may wait
+#define LAZYTIMES 1024
+#define TIMEPERIOD 30
+
+//directories remembered for their free slots, and slots kept for each
+#define DIRHINTS 1024
+#define DIRSLOTS 16
+
+//a directory block is packed once this many of its bytes are tombstones
+#define COMPACTBYTES (BLOCKSIZE/4)
+
+/*
+	packed inodes live in slots of a shared block, slot 0 holds the block's
+	header. their numbers have the top bit set and carry the block and slot
+*/
+#define PACKSHIFT 3
+#define PACKSLOTS (1<<PACKSHIFT)
+#define SLOTSIZE (BLOCKSIZE>>PACKSHIFT)
+#define PACKFLAG 0x80000000
+#define PACKCAP (SLOTSIZE-INODESIZE-BNUMSIZE)
+#define PACKED(id) (((id) & PACKFLAG) != 0)
+#define PACKBLOCK(id) (((id) & ~PACKFLAG) >> PACKSHIFT)
+#define INODEAT(id) (PACKED(id) ? INDEX(PACKBLOCK(id)) + ((id) & (PACKSLOTS-1))*SLOTSIZE : INDEX(id))
+
+//per operation scratch memory, names and entry records come from here
+#define ARENASIZE (16<<10)
+
+//free blocks at the front of the free list kept zeroed ahead of allocation
+#define ZEROPOOL 256
+#define POOLPERIOD 5
+
+//the block cache is split into pages found through a two level table
+#define PAGESHIFT 10
+#define CACHEPAGE (1<<PAGESHIFT)
+#define PAGEMASK (CACHEPAGE-1)
+#define MIDSHIFT 10
+#define MIDENTRIES (1<<MIDSHIFT)
+#define TOPENTRIES (1<<(32-PAGESHIFT-MIDSHIFT))
+
+//pages held before the least recently used are dropped, about 20 MiB
+#define CACHEPAGES 4096
+#define MINCACHEPAGES 16
+
+//a checkpointed cache page is its page number followed by its entries
+#define PAGERECORD (BNUMSIZE+CACHEPAGE*(BNUMSIZE+1))
+
+//blocks read per pass of the mount time prefetch, 1 MiB
+#define PREFETCHBLOCKS ((1<<20)>>BLOCKSHIFT)
+
+//kind cache bit for free blocks whose data area is known to be zero
+#define ZEROKIND 0x80
+#define KINDMASK 0x7f
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
 
 #define MAXDIRENTRYSIZE (BLOCKSIZE-16)
 
-#define LAZYWRITE(a, b) (pwrite(fs->fd, (void*)(&a), BNUMSIZE, INDEX(block_num)+b) != BNUMSIZE)
-#define dread(fd, buff, size, offset, msg) if(pread(fd, (void*)(buff), size, offset) != size){perror(msg);exit(-1);}
-#define dwrite(fd, buff, size, offset, msg) if(pwrite(fd, (void*)(buff), size, offset) != size){perror(msg);exit(-1);}
+//bytes a copy between files moves per pass, 1 MiB
+#define COPYCHUNK (1<<20)
+
+//image reads and writes see the metadata journal when the image has one, and snapshots
+ssize_t imgRead(int fd, void* buff, size_t size, uint64_t offset);
+ssize_t imgWrite(int fd, const void* buff, size_t size, uint64_t offset, bool data);
+ssize_t imgFresh(int fd, const void* buff, size_t size, uint64_t offset);
+uint32_t snapCount();
+void snapClaim(int fd, uint32_t block_num, uint32_t freed);
+
+#define LAZYWRITE(a, b) (imgWrite(fs->fd, (void*)(&a), BNUMSIZE, INODEAT(block_num)+b, false) != BNUMSIZE)
+#define dread(fd, buff, size, offset, msg) if(imgRead(fd, (void*)(buff), size, offset) != size){perror(msg);exit(-1);}
+#define dwrite(fd, buff, size, offset, msg) if(imgWrite(fd, (void*)(buff), size, offset, false) != size){perror(msg);exit(-1);}
+
+//straight to the image, for the journal's own writes
+#define rawwrite(fd, buff, size, offset, msg) if(pwrite(fd, (void*)(buff), size, offset) != size){perror(msg);exit(-1);}
+
+//file data skips the journal unless its block already has changes waiting there
+#define datawrite(fd, buff, size, offset, msg) if(imgWrite(fd, (void*)(buff), size, offset, true) != size){perror(msg);exit(-1);}
+
+//so do the heads of blocks just taken from the end of the image
+#define freshwrite(fd, buff, size, offset, msg) if(imgFresh(fd, (void*)(buff), size, offset) != size){perror(msg);exit(-1);}
 
 #define FILLINODE(md, sze) {\
 	inode.typeCode = INODE_NUM;\
@@ -79,11 +289,13 @@
 	inode.modTimeNS = res.tv_nsec;\
 }
 
+//a mounted snapshot can only be read
+#define ROCHECK if(fsargs.snapView != 0){return -EROFS;}
+
 #define FILLENTRY {\
 	entry.inode = inode;\
 	entry.inode_num = bnum;\
-	entry.name = (char*)calloc(sizeof(char), strlen(name)+1);\
-	memcpy(entry.name, name, strlen(name));\
+	entry.name = scratch.copy(name);\
 	entry.len = strlen(name)+LENSIZE+BNUMSIZE;\
 }
 
@@ -99,6 +311,81 @@ structs
 struct Args
 {
 	int fd;
+	bool upgrade;
+	bool prefetch;
+	bool stats;
+	bool pack;
+	bool mkfs;
+	bool journal;
+	bool lazytime;
+	uint8_t syncMode;
+	bool snapshot;
+	uint32_t snapView;
+	uint32_t snapDrop;
+	bool track;
+	char* send;
+	uint32_t sendFrom;
+	char* receive;
+};
+
+struct __attribute__ ((packed)) superExt{
+	uint32_t magic;
+	uint32_t features;
+	uint32_t orphanHead;
+
+	//free list heads of the allocation groups, group 0 keeps the original one
+	uint32_t agHead[AGMAX];
+
+	//cache checkpoint appended to the image by a clean unmount
+	uint32_t ckptStart;
+	uint32_t ckptBytes;
+	uint64_t ckptSum;
+
+	//pack blocks with free slots
+	uint32_t packHead;
+
+	//log2 of the block size the image was made with
+	uint32_t blockShift;
+
+	//metadata journal region
+	uint32_t journalStart;
+	uint32_t journalBlocks;
+
+	//snapshot table, the last generation handed out, and the end of the blocks snapshots took
+	uint32_t snapTable;
+	uint32_t snapGen;
+	uint32_t snapEnd;
+
+	//first block of the epoch table, and the epoch blocks written now are given
+	uint32_t epochHead;
+	uint32_t epoch;
+};
+
+//first block of the journal region
+struct journalHead{
+	uint32_t typeCode;
+
+	//records older than this were checkpointed
+	uint32_t seq;
+};
+
+//a journal record is this head and its block numbers, then the blocks themselves
+struct jrecHead{
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t count;
+
+	//the next record belongs to the same commit
+	uint32_t more;
+	uint64_t sum;
+};
+
+struct packHead{
+	uint32_t typeCode;
+	uint32_t used;
+	uint32_t next;
+	uint32_t prev;
+	uint32_t listed;
 };
 
 struct __attribute__ ((packed)) inodeHead{
@@ -127,536 +414,4738 @@ struct dirEntry{
 };
 
 /**************************************************************
-cache functions
+allocation
 **************************************************************/
 
-class Cache{
-	private:
-	uint32_t* nextcache;
-	uint64_t bmsize;
-
-	inline void expandCache();
-
-	public:
-	Cache();
-	~Cache();
-
-	inline uint32_t getNext(int fd, uint32_t block_num);
-	inline uint32_t getNextFree(int fd, uint32_t block_num);
-	inline void setNext(uint32_t cur_block_num, uint32_t next_block_num);
-	inline void setNext(int fd, uint32_t cur_block_num, uint32_t next_block_num);
-	inline void setNextFree(int fd, uint32_t cur_block_num, uint32_t next_block_num);
-	void release(int fd, uint32_t block_num);
+//cached next pointers and block kinds of CACHEPAGE consecutive blocks
+struct cachePage{
+	uint32_t next[CACHEPAGE];
+	uint8_t kind[CACHEPAGE];
+	uint32_t page;
+	bool used;
+};
 
-	uint32_t getNewBlock(int fd, void* buff, uint32_t headsize, bool purge);
+#ifndef SMARTALLOC
+
+/*
+	release builds take heap memory from free lists of power of two size
+	classes: a freed block waits in its class for the next request instead
+	of going back to malloc. a header in front of each block keeps its class,
+	and bigger requests go straight to malloc. cache pages are allocated
+	by the thousand and sit just past a power of two, they get a class of
+	their own. counters stand in for smartalloc's leak report
+*/
+#define POOLCLASSES 13
+#define POOLMIN 16
+#define POOLPAGE POOLCLASSES
+#define POOLLISTS (POOLCLASSES+1)
+
+union poolHead{
+	struct{
+		uint32_t cls;
+		uint32_t spare;
+		uint64_t size;
+	} used;
+	poolHead* next;
 };
 
-uint32_t Cache::getNewBlock(int fd, void* buff, uint32_t headsize, bool purge){
-	
-	uint32_t bnum = getNext(fd, 0);
-	struct stat sbuf;
-	
-	
-	if(bnum != 0){ 
-		setNext(fd, 0, getNextFree(fd, bnum));
-		setNext(fd, bnum, 0);
+static poolHead* poolLists[POOLLISTS];
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t poolAllocs, poolFrees, poolLive, poolPeak;
 
-		if(PDBG) fprintf(stderr, "_writing new head to block num %d\n",bnum);
-		
-		dwrite(fd, buff, headsize, INDEX(bnum), "failed to write block head when making block\n");
+static void* poolAlloc(size_t bytes){
 
-		if(purge){
-			dwrite(fd, EMPTY_BLOCK, BLOCKSIZE-BNUMSIZE-headsize, INDEX(bnum)+headsize, "failed to write inode head when making node\n");
-		}
-		if(PDBG) fprintf(stderr, "_got new block, number: %d\n",bnum);
+	poolHead* head = NULL;
+	uint32_t cls = 0;
+	size_t size;
+
+	//past the last class there is no list to go back to
+	if(bytes == sizeof(cachePage)){
+		cls = POOLPAGE;
 	}
 	else{
-		
-		if(fstat(fd,&sbuf) != 0){
-			perror("failed to fstat\n");
-			exit(-1);
+		while(cls < POOLCLASSES && ((size_t)POOLMIN << cls) < bytes){
+			cls++;
 		}
+		cls = cls < POOLCLASSES ? cls : POOLLISTS;
+	}
+	size = cls < POOLCLASSES ? (size_t)POOLMIN << cls : bytes;
 
-		bnum = (sbuf.st_size >> BLOCKSHIFT);
-		if(PDBG) fprintf(stderr, "!must append new block! current filesize: %d new block num %d\n",sbuf.st_size, bnum);
-		//writeblock(fd, EMPTY_BLOCK, bnum);
-		dwrite(fd, EMPTY_BLOCK, BLOCKSIZE, INDEX(bnum), "failed to create empty block\n");
-
-		dwrite(fd, buff, headsize, INDEX(bnum), "failed to write block head when making block\n");
-
-		//TODO add next value directly into cache?
+	pthread_mutex_lock(&poollock);
+	if(cls < POOLLISTS && (head = poolLists[cls]) != NULL){
+		poolLists[cls] = head->next;
 	}
+	else if((head = (poolHead*)(malloc)(sizeof(poolHead) + size)) == NULL){
+		pthread_mutex_unlock(&poollock);
+		return NULL;
+	}
+	head->used.cls = cls;
+	head->used.size = size;
 
+	poolAllocs++;
+	poolLive += size;
+	poolPeak = std::max(poolPeak, poolLive);
+	pthread_mutex_unlock(&poollock);
 
-	return bnum;
+	return head + 1;
 }
 
-Cache::Cache(){
-	bmsize = BLOCKSIZE<<1;
-	nextcache = (uint32_t*)malloc(sizeof(uint32_t)*bmsize);
-	memset(nextcache, -1, bmsize*sizeof(uint32_t));
-}
+static void* poolCalloc(size_t count, size_t bytes){
 
-Cache::~Cache(){
-	free(nextcache);
-}
+	void* data = poolAlloc(count*bytes);
 
-inline void Cache::expandCache(){
-	if(PDBG) fprintf(stderr, "_expanding cache\n");
-	bmsize = bmsize << 1;
-	if((nextcache = (uint32_t*)realloc(nextcache, sizeof(uint32_t)*bmsize)) == NULL){
-		perror("failed to reallocate cache");
-		exit(-1);
-	}
-	memset(nextcache+(bmsize>>1), -1, sizeof(uint32_t)*(bmsize>>1));
+	return data == NULL ? NULL : memset(data, 0, count*bytes);
 }
 
-inline uint32_t Cache::getNext(int fd, uint32_t block_num){
+static void poolFree(void* data){
 
-	uint32_t mru = -1;
-	if(PDBG) fprintf(stderr, "_cache value at %d = %d\n", block_num, nextcache[block_num]);
-	
-	if(block_num >= bmsize){
-		expandCache();
-	}
+	poolHead* head = (poolHead*)data - 1;
+	uint32_t cls;
 
-	if((signed)(mru = nextcache[block_num]) == -1){
-		if(PDBG) fprintf(stderr, "_reading new value into cache\n");
-		dread(fd, &(nextcache[block_num]), BNUMSIZE, INDEX(block_num)+BLOCKSIZE-BNUMSIZE, "failed to read value into cache");
-		mru = nextcache[block_num];
-		if(PDBG) fprintf(stderr, "_value is now %d\n",nextcache[block_num]);
+	if(data == NULL){
+		return;
 	}
-	/*
-		if(block_num == 0 && nextcache[block_num]==0){
-			exit(-1);
-		}
-		*/
 
-	return mru;
-}
-
-inline uint32_t Cache::getNextFree(int fd, uint32_t block_num){
+	//the link takes the place of the class and size
+	cls = head->used.cls;
 
-	uint32_t mru = -1;
-	if(PDBG) fprintf(stderr, "_cache value at %d = %d\n", block_num, nextcache[block_num]);
-	if(block_num >= bmsize){
-		expandCache();
+	pthread_mutex_lock(&poollock);
+	poolFrees++;
+	poolLive -= head->used.size;
+	if(cls < POOLLISTS){
+		head->next = poolLists[cls];
+		poolLists[cls] = head;
 	}
-
-	if((signed)(mru = nextcache[block_num]) == -1){
-		if(PDBG) fprintf(stderr, "_reading new value into cache\n");
-		dread(fd, &(nextcache[block_num]), BNUMSIZE, INDEX(block_num)+BNUMSIZE, "failed to read value into cache");
-		mru = nextcache[block_num];
-		if(PDBG) fprintf(stderr, "_value was %d\n",nextcache[block_num]);
+	else{
+		(free)(head);
 	}
-	return mru;
+	pthread_mutex_unlock(&poollock);
 }
 
-inline void Cache::setNext(uint32_t cur_block_num, uint32_t next_block_num){
-	if(PDBG) fprintf(stderr, "_set next of %d to %d",cur_block_num, next_block_num );
-	if(cur_block_num >= bmsize){
-		expandCache();
-	}
-	nextcache[cur_block_num] = next_block_num;
+//a block that still fits stays put, otherwise its contents move to one of a bigger class
+static void* poolRealloc(void* data, size_t bytes){
 
-}
+	void* moved;
+	size_t have;
 
-inline void Cache::setNext(int fd, uint32_t cur_block_num, uint32_t next_block_num){
-	if(PDBG) fprintf(stderr, "_set next with wb of %d to %d\n",cur_block_num, next_block_num);
-	if(cur_block_num >= bmsize){
-		expandCache();
+	if(data == NULL){
+		return poolAlloc(bytes);
 	}
-	nextcache[cur_block_num] = next_block_num;
-
-	dwrite(fd, (void*)(&next_block_num), BNUMSIZE, INDEX(cur_block_num)+BLOCKSIZE-BNUMSIZE, "failed to write next block num\n");
-
-}
-
-inline void Cache::setNextFree(int fd, uint32_t cur_block_num, uint32_t next_block_num){
-	
-	uint32_t zbuf = 0;
-	
-	if(PDBG) fprintf(stderr, "_set next (free) with wb of %d to %d\n",cur_block_num, next_block_num);
-	if(cur_block_num >= bmsize){
-		expandCache();
+	if(bytes <= (have = ((poolHead*)data - 1)->used.size)){
+		return data;
 	}
-	nextcache[cur_block_num] = next_block_num;
-
-	dwrite(fd, (void*)(&next_block_num), BNUMSIZE, INDEX(cur_block_num)+BNUMSIZE, "failed to write next block num\n");
-	dwrite(fd, (void*)(&zbuf), BNUMSIZE, INDEX(cur_block_num)+BLOCKSIZE-BNUMSIZE, "failed to write next block num\n");
+	if((moved = poolAlloc(bytes)) != NULL){
+		memcpy(moved, data, have);
+		poolFree(data);
+	}
+	return moved;
 }
 
-void Cache::release(int fd, uint32_t block_num){
-	//initialize free block stack
-	uint32_t free_num_buff = FREE_NUM;
+#define malloc(x) poolAlloc(x)
+#define calloc(x, y) poolCalloc((x), (y))
+#define realloc(x, y) poolRealloc((x), (y))
+#define free(x) poolFree(x)
 
-	//free targeted block
-	dwrite(fd, (void*)(&free_num_buff), BNUMSIZE, INDEX(block_num), "failed to write continuing block num");
+#endif
 
-	//point free block towards free list
-	setNextFree(fd, block_num, getNext(fd, 0));
+//allocation counters for the stats report
+static int allocStats(char* buff, size_t size){
 
-	//update next free block in both cache and super block
-	setNext(fd, 0, block_num);
+#ifdef SMARTALLOC
+	return snprintf(buff, size, "heap %lu bytes outstanding (smartalloc)\n", report_space());
+#else
+	int len;
 
+	pthread_mutex_lock(&poollock);
+	len = snprintf(buff, size, "heap %lu allocs %lu frees %lu bytes live %lu peak\n", poolAllocs, poolFrees, poolLive, poolPeak);
+	pthread_mutex_unlock(&poollock);
+	return len;
+#endif
 }
 
-Cache ncache;
-
 /**************************************************************
-Helper functions
+cache functions
 **************************************************************/
 
-/*verified*/
-inodeHead readInode(int fd, uint32_t offset){
-	//fprintf(stderr,"reading Inode at offset: %d\n",offset);
-	inodeHead node;
-
-	dread(fd, &node, INODESIZE, offset, "failed to read entire Inode header\n");
-
-	return node;
-}
+//wakes the pool thread when a block is taken off the free list
+pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
 
-void chainFree(int fd, uint32_t start_block){
+superExt sext;
 
-	uint32_t target_block = start_block;
-	uint32_t next_target;
-	if(PDBG) fprintf(stderr, "chain free\n");
-	while(target_block != 0){
-		next_target = ncache.getNext(fd, target_block);
-		ncache.release(fd, target_block);
-		target_block = next_target;
-	}
-}
+class Cache{
+	private:
+	cachePage** table[TOPENTRIES];
+	cachePage** resident;
+	uint32_t residentCount;
+	uint32_t maxPages;
+	uint32_t hand;
+	pthread_mutex_t pagelock;
+
+	//blocks from tailStart to the end of the image are zero and belong to no one
+	uint32_t tailStart;
+	uint32_t tailEnd;
+
+	//each allocation group has a free list of its own behind its own lock
+	pthread_mutex_t aglock[AGMAX];
+	pthread_mutex_t taillock;
+
+	cachePage* findPage(uint32_t block_num);
+	void loadTail(int fd);
+	inline uint32_t groupHead(int fd, uint32_t group);
+	inline void setGroupHead(int fd, uint32_t group, uint32_t block_num);
+	uint32_t popFree(int fd, uint32_t group, void* buff, uint32_t headsize, bool purge);
+	void pushFree(int fd, uint32_t block_num);
 
-/**************************************************************
-Classes
-**************************************************************/
+	public:
+	Cache();
+	~Cache();
 
+	inline uint32_t getNext(int fd, uint32_t block_num);
+	inline uint32_t getNextFree(int fd, uint32_t block_num);
+	inline void setNext(uint32_t cur_block_num, uint32_t next_block_num);
+	inline void setNext(int fd, uint32_t cur_block_num, uint32_t next_block_num);
+	inline uint32_t getKind(int fd, uint32_t block_num);
+	inline void setKind(uint32_t block_num, uint32_t kind);
+	inline bool isZeroed(uint32_t block_num);
+	inline void setZeroed(uint32_t block_num, bool zeroed);
+	void setLimit(uint32_t pages);
+	uint64_t capacity(){return (uint64_t)maxPages*CACHEPAGE;}
+	void fill(uint32_t first, uint32_t count, const uint8_t* blocks);
+	uint32_t checkpoint(int fd, off_t at, uint64_t* sum);
+	bool restore(int fd, off_t at, uint32_t bytes, uint64_t sum);
+	void release(int fd, uint32_t block_num);
+	void releaseChain(int fd, uint32_t block_num);
 
-/**************************************************************
-FileCursor
-**************************************************************/
-class FileCursor{
-	public:
-	uint32_t base;
-	uint32_t offset;
-	uint32_t prev;
+	uint32_t growChunk;
 
-	dirEntry readDirEntry(int fd);
-	void moveToExtent(int fd, uint32_t headSize);
-	bool atEnd(){return ENDBLOCK(base, offset);}
+	uint32_t usedBlocks(int fd);
+	uint32_t groupCount(int fd);
+	inline uint32_t groupOf(uint32_t block_num);
+	uint32_t spreadGroup(int fd, uint32_t block_num);
 
-	FileCursor(uint32_t block_num, uint32_t headSize){base = INDEX(block_num); offset = base+headSize; prev = 0;}
-	FileCursor(){base = 0; offset = 0; prev = 0;}
+	uint32_t getNewBlock(int fd, void* buff, uint32_t headsize, bool purge, uint32_t group);
+	uint32_t getNewRun(int fd, uint32_t count, uint32_t owner, uint32_t kind);
+	uint32_t takeTail(int fd, uint32_t count);
+	void trimTail(int fd);
+	bool zeroAhead(int fd, uint32_t depth);
 };
 
-dirEntry FileCursor::readDirEntry(int fd){
-
-	dirEntry entry;
+/*
+	takes the first block off the free list of group, the group's lock must
+	be held. returns 0 if the group has no free blocks
+*/
+uint32_t Cache::popFree(int fd, uint32_t group, void* buff, uint32_t headsize, bool purge){
+	
+	uint32_t bnum = groupHead(fd, group);
+	uint32_t freeHead[3] = {FREE_NUM, 0, sext.snapGen};
+	uint8_t head[INODESIZE] = {0};
+	uint32_t rest;
+	
+	
+	if(bnum != 0){ 
+		freeHead[1] = getNextFree(fd, bnum);
 
-	if(base != 0){
-		dread(fd, &(entry.len), LENSIZE, offset, "failed to read dir entry size\n")
-		else{
-			offset += entry.len != 0 ? LENSIZE : 0;
+		//a block freed since a snapshot was taken may still be seen by it
+		if(snapCount() != 0){
+			dread(fd, freeHead+2, BNUMSIZE, INDEX(bnum)+TYPECODESIZE+BNUMSIZE, "failed to read free generation\n");
+			snapClaim(fd, bnum, freeHead[2]);
 		}
-	}
-	else{
-		entry.len = 0;
-	}
 
-	if(entry.len != 0){
-		dread(fd, &(entry.inode_num), BNUMSIZE, offset, "failed to read dir entry inode number\n")
-		else{
-			offset += BNUMSIZE;
+		//the rest of a chain freed along with this block takes its place on the free list
+		if((rest = getNext(fd, bnum)) != 0){
+			snapClaim(fd, rest, freeHead[2]);
+			dwrite(fd, freeHead, FREEHEADSIZE, INDEX(rest), "failed to split freed chain\n");
+			setKind(rest, FREE_NUM);
+			freeHead[1] = rest;
 		}
+
+		setGroupHead(fd, group, freeHead[1]);
+		setNext(fd, bnum, 0);
+
+		if(PDBG) fprintf(stderr, "_writing new head to block num %d\n",bnum);
 		
+		if(purge && isZeroed(bnum)){
 
-		if((entry.name = (char*)calloc(entry.len+1-BNUMSIZE-LENSIZE, sizeof(char))) == NULL){
-			perror("failed to allocate space for dir entry name\n");
-			//fprintf(stderr, "tried to allocate size of %d bytes\n", entry.len+1-BNUMSIZE-LENSIZE);
-			exit(-1);
+			//the pool thread already zeroed the block, only the free list link is left behind the head
+			memcpy(head, buff, headsize);
+			dwrite(fd, head, std::max(headsize, (uint32_t)FREEHEADSIZE), INDEX(bnum), "failed to write block head when making block\n");
 		}
-
-		dread(fd, entry.name, entry.len-BNUMSIZE-LENSIZE, offset, "failed to read dir entry name\n")
 		else{
-			offset += entry.len-BNUMSIZE-LENSIZE;
+			dwrite(fd, buff, headsize, INDEX(bnum), "failed to write block head when making block\n");
+
+			if(purge){
+				dwrite(fd, EMPTY_BLOCK, BLOCKSIZE-BNUMSIZE-headsize, INDEX(bnum)+headsize, "failed to write inode head when making node\n");
+			}
 		}
-	}
-	else{
-		entry.name = NULL;
+		if(PDBG) fprintf(stderr, "_got new block, number: %d\n",bnum);
 
+		setZeroed(bnum, false);
+		setKind(bnum, *((uint32_t*)buff));
+		pthread_cond_signal(&poolWake);
 	}
-	//fprintf(stderr, "finished reading dir entry and found len %d, inode num %x, and name %s\n",entry.len, entry.inode_num, entry.name);
-	return entry;
-}
-
-void FileCursor::moveToExtent(int fd, uint32_t headSize){
-	prev = base;
-	base = INDEX(ncache.getNext(fd, base>>BLOCKSHIFT));
-	offset = base + headSize;
 
+	return bnum;
 }
 
+/*
+	allocates a block, preferring the free list of group and moving on to the
+	other groups before the image is grown
+*/
+uint32_t Cache::getNewBlock(int fd, void* buff, uint32_t headsize, bool purge, uint32_t group){
 
+	uint32_t groups = groupCount(fd);
+	uint32_t bnum = 0;
+	uint32_t g;
 
-/**************************************************************
-DirData
-**************************************************************/
-class DirData{
+	for(uint32_t i = 0; i < groups && bnum == 0; i++){
+		g = (group + i) % groups;
 
-	private:
-	void writeInsert(dirEntry entry);
+		pthread_mutex_lock(&aglock[g]);
+		bnum = popFree(fd, g, buff, headsize, purge);
+		pthread_mutex_unlock(&aglock[g]);
+	}
 
-	public:
-	dirEntry entry;
-	FileCursor cursor;
-	int fd;
-	inodeHead parentDir;
-	uint32_t parent_offset;
-	bool found;
+	if(bnum == 0 && (bnum = takeTail(fd, 1)) != 0){
 
-	
-	DirData(int fd, uint32_t block_num, const char* name);
-	DirData(int fd, uint32_t block_num);
-	DirData(int fd, uint32_t parent_block_num, dirEntry entry);
-	~DirData();
+		//blocks past the used part of the image are already zero
+		if(PDBG) fprintf(stderr, "!taking block %d from the end of the image\n", bnum);
+		dwrite(fd, buff, headsize, INDEX(bnum), "failed to write block head when making block\n");
+		setNext(bnum, 0);
+		setKind(bnum, *((uint32_t*)buff));
+	}
 
-	bool nextEntry();
-	bool check(const char* name);
-	void removeDirEntry();
-	void decouple();
-	void updateEntryInode(){entry.inode = readInode(fd, INDEX(entry.inode_num));}
-	bool insertEntry(dirEntry entry);
+	return bnum;
+}
 
-	bool exists(){return found;}
-	bool entryIsEmpty(){return entry.inode.size == 0;}
-	uint16_t entryMode(){return entry.inode.mode;}
+uint32_t Cache::usedBlocks(int fd){
 
-	void remove(){
-		removeDirEntry();
-		chainFree(fd, entry.inode_num);
-	}
+	uint32_t used;
 
-};
+	pthread_mutex_lock(&taillock);
+	if(tailEnd == 0){
+		loadTail(fd);
+	}
+	used = tailStart;
+	pthread_mutex_unlock(&taillock);
 
+	return used;
+}
 
-void DirData::removeDirEntry(){
-	
-	char remainder[BLOCKSIZE] = {0};
-	uint32_t remaindersize = BLOCKSIZE+cursor.base-cursor.offset - BNUMSIZE;
+uint32_t Cache::groupCount(int fd){
 
-	uint32_t starset = cursor.offset-entry.len;
-	uint64_t newDirSize = parentDir.size-entry.len;
+	if(!(sext.features & AGFEATURE)){
+		return 1;
+	}
 
-	uint32_t nextnum;
+	pthread_mutex_lock(&taillock);
+	if(tailEnd == 0){
+		loadTail(fd);
+	}
+	pthread_mutex_unlock(&taillock);
 
-	//shift remainder of directory data to cover over the deleted entry
-	dread(fd, remainder, remaindersize, starset+entry.len, "failed to read dir remainder\n");
-	dwrite(fd, remainder, remaindersize+entry.len, starset, "failed to write dir remainder\n");
+	return std::min((tailEnd + AGBLOCKS - 1)/AGBLOCKS, (uint32_t)AGMAX);
+}
 
-	//update new directory size
-	dwrite(fd, &newDirSize, SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
+inline uint32_t Cache::groupOf(uint32_t block_num){
+	return (sext.features & AGFEATURE) ? (block_num / AGBLOCKS) % AGMAX : 0;
+}
 
-	//check if an extent block has now been emptied and should be freed
-	if(remainder[0] == 0 && cursor.offset - cursor.base == BNUMSIZE){
+/*
+	picks a group for a new directory by hashing the calling thread with the
+	parent, so directories made side by side end up in different groups
+*/
+uint32_t Cache::spreadGroup(int fd, uint32_t block_num){
 
-		nextnum = ncache.getNext(fd, cursor.base >> BLOCKSHIFT);
-		ncache.release(fd, cursor.base >> BLOCKSHIFT);
-		
-		//connect previous block to next block
-		ncache.setNext(fd, cursor.prev>>BLOCKSHIFT, nextnum);
+	uint64_t hash = ((uint64_t)pthread_self() ^ block_num) * 0x9E3779B97F4A7C15ULL;
 
-		parentDir.blocks -= 1;
-		
-		dwrite(fd, &(parentDir.blocks), ALLBLOCKSSIZE, parent_offset+ALLBLOCKSDEX, "failed to write new dir size\n");
+	return (hash >> 32) % groupCount(fd);
+}
 
-	}
+inline uint32_t Cache::groupHead(int fd, uint32_t group){
+	return group == 0 ? getNext(fd, 0) : sext.agHead[group];
 }
 
-bool DirData::nextEntry(){
+inline void Cache::setGroupHead(int fd, uint32_t group, uint32_t block_num){
 
-	if(entry.name != NULL){
-		free(entry.name);
+	if(group == 0){
+		setNext(fd, 0, block_num);
 	}
+	else{
+		sext.agHead[group] = block_num;
+		dwrite(fd, &(sext.agHead[group]), BNUMSIZE, EXTDEX+offsetof(superExt, agHead)+group*BNUMSIZE, "failed to update group free list\n");
+	}
+}
+
+/*
+	reads the size of the image once and finds where its unused, zero tail
+	starts. a chunk that was only partly handed out before a crash is found
+	again by its blocks having no type code
+*/
+void Cache::loadTail(int fd){
 
-	entry = cursor.readDirEntry(fd);
+	struct stat sbuf;
+	uint32_t kind;
 
-	if(entry.len == 0){
-		if(cursor.base != 0) cursor.moveToExtent(fd, DIREXTENTHEADSIZE);
-		if(cursor.base != 0) nextEntry();
+	if(fstat(fd,&sbuf) != 0){
+		perror("failed to fstat\n");
+		exit(-1);
 	}
-	else if(cursor.atEnd()){
-		cursor.moveToExtent(fd, DIREXTENTHEADSIZE);
+	tailEnd = std::min((uint64_t)(sbuf.st_size >> BLOCKSHIFT), MAXBLOCKS);
+
+	for(tailStart = tailEnd; tailStart > 1; tailStart--){
+		dread(fd, &kind, TYPECODESIZE, INDEX((off_t)tailStart-1), "failed to read block type of image tail\n");
+		if(kind != 0){
+			break;
+		}
 	}
 
-	//if(PDBG) fprintf(stderr, "got next entry, base at: %d, name: %s\n", cursor.base, entry.name);
-	
-	return entry.len != 0;
+	//a snapshot copy can start with anything, zero included
+	if(sext.features & SNAPFEATURE){
+		tailStart = std::max(tailStart, std::min(sext.snapEnd, tailEnd));
+	}
 }
 
-bool DirData::check(const char* name){
-	if(entry.name != NULL && strcmp(name, entry.name) == 0){
-		updateEntryInode();
-		
-		if(PDBG) fprintf(stderr,"found dir entry in parent dir - len: %d name: %s\n", entry.len, entry.name);
-		return true;
+/*
+	hands out count contiguous zero blocks from the end of the image. the
+	backing file grows a whole chunk at a time so most calls never touch it
+*/
+uint32_t Cache::takeTail(int fd, uint32_t count){
+
+	uint32_t first;
+	uint32_t grow;
+
+	pthread_mutex_lock(&taillock);
+	if(tailEnd == 0){
+		loadTail(fd);
 	}
-	return false;
-}
 
-void DirData::decouple(){
+	//the last chunk may come up short, past it there are no block numbers left
+	if((uint64_t)tailStart + count > MAXBLOCKS){
+		pthread_mutex_unlock(&taillock);
+		return 0;
+	}
 
-	entry.inode.Nlink--;
-	if(PDBG) fprintf(stderr, "Nlink count is now: %d\n", (int)(entry.inode.Nlink));
+	if(tailStart + count > tailEnd){
+		grow = std::min(std::max(growChunk, tailStart + count - tailEnd), (uint32_t)(MAXBLOCKS - tailEnd));
+		if(PDBG) fprintf(stderr, "!growing image by %d blocks\n", grow);
 
-	if(entry.inode.Nlink == 0){
-			chainFree(fd, entry.inode_num);	
+#ifdef LINUX
+		if(fallocate(fd, 0, INDEX((off_t)tailEnd), INDEX((off_t)grow)) != 0)
+#endif
+		if(ftruncate(fd, INDEX((off_t)tailEnd + grow)) != 0){
+			perror("failed to grow image\n");
+			pthread_mutex_unlock(&taillock);
+			return 0;
 		}
-	else{
+		tailEnd += grow;
+	}
+
+	first = tailStart;
+	tailStart += count;
+	pthread_mutex_unlock(&taillock);
+	return first;
+}
 
-		dwrite(fd,&(entry.inode.Nlink), NLINKSIZE, INDEX(entry.inode_num)+NLINKDEX,"failed to decrement Nlink\n");
+/*
+	gives the unused part of the last chunk back, including one left over by a
+	crash, so a cleanly unmounted image ends with its last used block
+*/
+void Cache::trimTail(int fd){
 
+	pthread_mutex_lock(&taillock);
+	if(tailEnd == 0){
+		loadTail(fd);
 	}
 
+	if(tailEnd > tailStart){
+		if(ftruncate(fd, INDEX((off_t)tailStart)) == 0){
+			tailEnd = tailStart;
+		}
+		else{
+			perror("failed to trim image\n");
+		}
+	}
+	pthread_mutex_unlock(&taillock);
 }
 
-bool DirData::insertEntry(dirEntry entry){
+/*
+	zeros the data area of the first block among the next depth blocks the
+	free list of any group will hand out that is not zeroed yet. the free list
+	link and the chain pointer are left alone. returns false if there was none
+*/
+bool Cache::zeroAhead(int fd, uint32_t depth){
 
-	dirEntry curE;
-	bool inserted = false;
-	uint32_t buffer = DEXTENT_NUM;
-	parentDir.size += entry.len;
+	uint32_t groups = groupCount(fd);
+	uint32_t head;
+	uint32_t bnum;
+	uint32_t next;
+	uint32_t left;
+	bool zeroed = false;
+
+	//zeroing would cost a snapshot copy of every block it touches
+	if(snapCount() != 0){
+		return false;
+	}
+
+	for(uint32_t g = 0; g < groups && !zeroed; g++){
+
+		pthread_mutex_lock(&aglock[g]);
+		bnum = head = groupHead(fd, g);
+		left = depth;
+		while(bnum != 0 && left-- > 0 && !zeroed){
+			next = getNext(fd, bnum);
+
+			if(!isZeroed(bnum)){
+				dwrite(fd, EMPTY_BLOCK, BLOCKSIZE-BNUMSIZE-TYPECODESIZE-BNUMSIZE, INDEX(bnum)+TYPECODESIZE+BNUMSIZE, "failed to zero free block\n");
+				setZeroed(bnum, true);
+				zeroed = true;
+			}
+
+			//blocks of a freed chain come off the list before the next free chain
+			else if(next != 0){
+				bnum = next;
+			}
+			else{
+				bnum = head = getNextFree(fd, head);
+			}
+		}
+		pthread_mutex_unlock(&aglock[g]);
+	}
+	return zeroed;
+}
+
+/*
+	reserves count contiguous blocks from the end of the image. the blocks are
+	chained together and marked as extents of owner of the given kind, their
+	data area is never touched. blocks from the end of the image are zero, so
+	regular extents read back as zeros too
+*/
+uint32_t Cache::getNewRun(int fd, uint32_t count, uint32_t owner, uint32_t kind){
+
+	uint32_t first;
+	uint32_t bnum;
+	uint32_t boundary[3] = {0, kind, owner};
+
+	if((first = takeTail(fd, count)) == 0){
+		return 0;
+	}
+
+	//the next pointer of a block and the head of its successor are adjacent on disk
+	freshwrite(fd, boundary+1, FILEEXTENTHEADSIZE, INDEX((off_t)first), "failed to write preallocated extent head\n");
+	setKind(first, kind);
+	for(bnum = first+1; bnum < first+count; bnum++){
+		boundary[0] = bnum;
+		freshwrite(fd, boundary, BNUMSIZE+FILEEXTENTHEADSIZE, INDEX((off_t)bnum)-BNUMSIZE, "failed to link preallocated extent\n");
+		setNext(bnum-1, bnum);
+		setKind(bnum, kind);
+	}
+	setNext(first+count-1, 0);
+
+	if(PDBG) fprintf(stderr, "_preallocated %d blocks starting at %d\n", count, first);
+	return first;
+}
+
+Cache::Cache(){
+	memset(table, 0, sizeof(table));
+	maxPages = CACHEPAGES;
+	residentCount = 0;
+	hand = 0;
+	if((resident = (cachePage**)malloc(sizeof(cachePage*)*maxPages)) == NULL){
+		perror("failed to allocate cache");
+		exit(-1);
+	}
+	pthread_mutex_init(&pagelock, NULL);
+
+	tailStart = 0;
+	tailEnd = 0;
+	growChunk = GROWCHUNK;
+
+	for(int g = 0; g < AGMAX; g++){
+		pthread_mutex_init(&aglock[g], NULL);
+	}
+	pthread_mutex_init(&taillock, NULL);
+}
+
+Cache::~Cache(){
+	for(uint32_t i = 0; i < residentCount; i++){
+		free(resident[i]);
+	}
+	for(uint32_t i = 0; i < TOPENTRIES; i++){
+		if(table[i] != NULL){
+			free(table[i]);
+		}
+	}
+	free(resident);
+}
+
+/*
+	changes how many pages the cache may hold, it never drops below the
+	pages already in memory
+*/
+void Cache::setLimit(uint32_t pages){
+
+	pthread_mutex_lock(&pagelock);
+	maxPages = std::max(std::max(pages, (uint32_t)MINCACHEPAGES), residentCount);
+	if((resident = (cachePage**)realloc(resident, sizeof(cachePage*)*maxPages)) == NULL){
+		perror("failed to reallocate cache");
+		exit(-1);
+	}
+	pthread_mutex_unlock(&pagelock);
+}
+
+/*
+	returns the page holding block_num, bringing it in if needed. once the
+	cache is full a clock sweep hands out the first page not used since the
+	hand last went past it. everything in a page can be read back from the
+	image, so dropping one only costs rereads. pagelock must be held
+*/
+cachePage* Cache::findPage(uint32_t block_num){
+
+	uint32_t top = block_num >> (PAGESHIFT+MIDSHIFT);
+	uint32_t mid = (block_num >> PAGESHIFT) & (MIDENTRIES-1);
+	cachePage* page;
+
+	if(table[top] == NULL && (table[top] = (cachePage**)calloc(MIDENTRIES, sizeof(cachePage*))) == NULL){
+		perror("failed to allocate cache table");
+		exit(-1);
+	}
+
+	if((page = table[top][mid]) == NULL){
+
+		if(residentCount < maxPages){
+			if((page = (cachePage*)malloc(sizeof(cachePage))) == NULL){
+				perror("failed to allocate cache page");
+				exit(-1);
+			}
+			resident[residentCount++] = page;
+		}
+		else{
+			while(resident[hand]->used){
+				resident[hand]->used = false;
+				hand = (hand+1) % residentCount;
+			}
+			page = resident[hand];
+			hand = (hand+1) % residentCount;
+
+			if(PDBG) fprintf(stderr, "_dropping cache page %d\n", page->page);
+			table[page->page >> MIDSHIFT][page->page & (MIDENTRIES-1)] = NULL;
+		}
+
+		memset(page->next, -1, sizeof(page->next));
+		memset(page->kind, 0, sizeof(page->kind));
+		page->page = block_num >> PAGESHIFT;
+		table[top][mid] = page;
+	}
+
+	page->used = true;
+	return page;
+}
+
+/*
+	fills the cache from count whole blocks read straight from the image,
+	starting at block first. entries already cached are newer and kept
+*/
+void Cache::fill(uint32_t first, uint32_t count, const uint8_t* blocks){
+
+	cachePage* page;
+	uint32_t slot;
+
+	pthread_mutex_lock(&pagelock);
+	for(uint32_t b = first; b < first+count; b++, blocks += BLOCKSIZE){
+		page = findPage(b);
+		slot = b & PAGEMASK;
+
+		if((signed)page->next[slot] == -1){
+			page->next[slot] = *((uint32_t*)(blocks+BLOCKSIZE-BNUMSIZE));
+		}
+		if((page->kind[slot] & KINDMASK) == 0){
+			page->kind[slot] |= *((uint32_t*)blocks);
+		}
+	}
+	pthread_mutex_unlock(&pagelock);
+}
+
+//64 bit FNV-1a over a checkpoint or journal record, pass the last result as hash to carry on over another buffer
+uint64_t checksum(const uint8_t* data, uint64_t len, uint64_t hash = 0xcbf29ce484222325ULL){
+
+	for(uint64_t i = 0; i < len; i++){
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+	writes every page in memory to the image at byte at with one write and
+	returns its length, the checksum goes in sum. returns 0 on failure
+*/
+uint32_t Cache::checkpoint(int fd, off_t at, uint64_t* sum){
+
+	uint8_t* buff;
+	uint8_t* rec;
+	uint32_t bytes;
+
+	pthread_mutex_lock(&pagelock);
+	bytes = residentCount*PAGERECORD;
+
+	if(bytes == 0 || (buff = (uint8_t*)malloc(bytes)) == NULL){
+		pthread_mutex_unlock(&pagelock);
+		return 0;
+	}
+
+	rec = buff;
+	for(uint32_t i = 0; i < residentCount; i++, rec += PAGERECORD){
+		*((uint32_t*)rec) = resident[i]->page;
+		memcpy(rec+BNUMSIZE, resident[i]->next, sizeof(resident[i]->next));
+		memcpy(rec+BNUMSIZE+sizeof(resident[i]->next), resident[i]->kind, sizeof(resident[i]->kind));
+	}
+	pthread_mutex_unlock(&pagelock);
+
+	*sum = checksum(buff, bytes);
+	if(pwrite(fd, buff, bytes, at) != bytes){
+		perror("failed to write cache checkpoint");
+		bytes = 0;
+	}
+
+	free(buff);
+	return bytes;
+}
+
+/*
+	loads a checkpoint written by checkpoint with one read. nothing is loaded
+	unless the checksum matches
+*/
+bool Cache::restore(int fd, off_t at, uint32_t bytes, uint64_t sum){
+
+	uint8_t* buff;
+	uint8_t* rec;
+	cachePage* page;
+	bool valid;
+
+	if(bytes % PAGERECORD != 0 || (buff = (uint8_t*)malloc(bytes)) == NULL){
+		return false;
+	}
+
+	valid = pread(fd, buff, bytes, at) == bytes && checksum(buff, bytes) == sum;
+
+	pthread_mutex_lock(&pagelock);
+	for(rec = buff; valid && rec < buff+bytes; rec += PAGERECORD){
+		page = findPage(*((uint32_t*)rec) << PAGESHIFT);
+		memcpy(page->next, rec+BNUMSIZE, sizeof(page->next));
+		memcpy(page->kind, rec+BNUMSIZE+sizeof(page->next), sizeof(page->kind));
+	}
+	pthread_mutex_unlock(&pagelock);
+
+	free(buff);
+	return valid;
+}
+
+inline uint32_t Cache::getNext(int fd, uint32_t block_num){
+
+	uint32_t mru = -1;
+	uint32_t* slot;
+
+	pthread_mutex_lock(&pagelock);
+	slot = &(findPage(block_num)->next[block_num & PAGEMASK]);
+	if(PDBG) fprintf(stderr, "_cache value at %d = %d\n", block_num, *slot);
+
+	if((signed)(mru = *slot) == -1){
+		if(PDBG) fprintf(stderr, "_reading new value into cache\n");
+		dread(fd, slot, BNUMSIZE, INDEX(block_num)+BLOCKSIZE-BNUMSIZE, "failed to read value into cache");
+		mru = *slot;
+		if(PDBG) fprintf(stderr, "_value is now %d\n", mru);
+	}
+	pthread_mutex_unlock(&pagelock);
+
+	return mru;
+}
+
+inline uint32_t Cache::getNextFree(int fd, uint32_t block_num){
+
+	uint32_t next;
+
+	//the free list link lives next to the type code, apart from the chain pointer kept in the cache
+	dread(fd, &next, BNUMSIZE, INDEX(block_num)+TYPECODESIZE, "failed to read next free block num");
+	if(PDBG) fprintf(stderr, "_next free after %d is %d\n", block_num, next);
+	return next;
+}
+
+inline void Cache::setNext(uint32_t cur_block_num, uint32_t next_block_num){
+	if(PDBG) fprintf(stderr, "_set next of %d to %d",cur_block_num, next_block_num );
+	pthread_mutex_lock(&pagelock);
+	findPage(cur_block_num)->next[cur_block_num & PAGEMASK] = next_block_num;
+	pthread_mutex_unlock(&pagelock);
+}
+
+inline void Cache::setNext(int fd, uint32_t cur_block_num, uint32_t next_block_num){
+	if(PDBG) fprintf(stderr, "_set next with wb of %d to %d\n",cur_block_num, next_block_num);
+	setNext(cur_block_num, next_block_num);
+
+	dwrite(fd, (void*)(&next_block_num), BNUMSIZE, INDEX(cur_block_num)+BLOCKSIZE-BNUMSIZE, "failed to write next block num\n");
+
+}
+
+inline uint32_t Cache::getKind(int fd, uint32_t block_num){
+
+	uint32_t kind;
+	uint8_t* slot;
+
+	pthread_mutex_lock(&pagelock);
+	slot = &(findPage(block_num)->kind[block_num & PAGEMASK]);
+	if((*slot & KINDMASK) == 0){
+		dread(fd, &kind, TYPECODESIZE, INDEX(block_num), "failed to read block type into cache");
+		*slot |= kind;
+	}
+	kind = *slot & KINDMASK;
+	pthread_mutex_unlock(&pagelock);
+
+	return kind;
+}
+
+inline void Cache::setKind(uint32_t block_num, uint32_t kind){
+
+	uint8_t* slot;
+
+	pthread_mutex_lock(&pagelock);
+	slot = &(findPage(block_num)->kind[block_num & PAGEMASK]);
+	*slot = (*slot & ZEROKIND) | kind;
+	pthread_mutex_unlock(&pagelock);
+}
+
+inline bool Cache::isZeroed(uint32_t block_num){
+
+	bool zeroed;
+
+	pthread_mutex_lock(&pagelock);
+	zeroed = findPage(block_num)->kind[block_num & PAGEMASK] & ZEROKIND;
+	pthread_mutex_unlock(&pagelock);
+
+	return zeroed;
+}
+
+inline void Cache::setZeroed(uint32_t block_num, bool zeroed){
+
+	uint8_t* slot;
+
+	pthread_mutex_lock(&pagelock);
+	slot = &(findPage(block_num)->kind[block_num & PAGEMASK]);
+	*slot = zeroed ? (*slot | ZEROKIND) : (*slot & KINDMASK);
+	pthread_mutex_unlock(&pagelock);
+}
+
+void Cache::release(int fd, uint32_t block_num){
+
+	//a lone block must not take its old successors with it
+	setNext(fd, block_num, 0);
+	pushFree(fd, block_num);
+}
+
+/*
+	puts a whole chain on the free list of its head's group in constant time.
+	only the head is marked free, the rest of the chain stays linked behind it
+	through the regular next pointers and is split off a block at a time by
+	popFree. images without FREECHAINFEATURE have every block freed on its
+	own, legacy tools don't know to follow a free block's chain pointer
+*/
+void Cache::releaseChain(int fd, uint32_t block_num){
+
+	uint32_t next;
+
+	if(sext.features & FREECHAINFEATURE){
+		pushFree(fd, block_num);
+		return;
+	}
+
+	for(; block_num != 0; block_num = next){
+		next = getNext(fd, block_num);
+		release(fd, block_num);
+	}
+}
+
+//marks the block free and puts it on the free list of its group, its chain pointer goes along untouched
+void Cache::pushFree(int fd, uint32_t block_num){
+
+	uint32_t group = groupOf(block_num);
+	uint32_t freeHead[3] = {FREE_NUM, 0, sext.snapGen};
+
+	pthread_mutex_lock(&aglock[group]);
+	freeHead[1] = groupHead(fd, group);
+
+	//point the head of the chain towards the free list of its group
+	dwrite(fd, freeHead, FREEHEADSIZE, INDEX(block_num), "failed to free block\n");
+	setKind(block_num, FREE_NUM);
+
+	//update next free block in both cache and super block
+	setGroupHead(fd, group, block_num);
+	pthread_mutex_unlock(&aglock[group]);
+}
+
+Cache ncache;
+struct Args fsargs;
+
+/**************************************************************
+journal
+**************************************************************/
+
+/*
+	with the journal feature, changed metadata blocks stay in memory until a
+	commit writes them to the journal region as one record and syncs it once
+	for every operation since the last commit. a checkpoint later writes them
+	home and empties the journal. reads see the newest version of a block.
+	a mount after a crash replays every complete commit
+*/
+struct jblock{
+	uint32_t block;
+
+	//next entry in the bucket plus one, 0 ends it
+	uint32_t next;
+	bool used;
+
+	//changed since the last commit
+	bool dirty;
+
+	//committed and being written home, never changed again
+	bool flushing;
+};
+
+class Journal{
+	private:
+	jblock* entries;
+	uint8_t* data;
+	uint32_t* buckets;
+	uint32_t* batch;
+	uint8_t* record;
+	uint32_t freeList;
+	uint32_t used;
+	uint32_t start;
+	uint32_t pos;
+	uint32_t seq;
+	bool wrote;
+	bool ckpt;
+
+	//blocks went home around the journal that the next commit may link to
+	bool order;
+
+	//entries against a checkpoint dropping them, and records and checkpoints against each other
+	pthread_mutex_t lock;
+	pthread_mutex_t io;
+
+	uint8_t* image(jblock* entry){return data+(uint64_t)(entry-entries)*BLOCKSIZE;}
+	jblock* find(uint32_t block);
+	jblock* take(int fd, uint32_t block, bool whole);
+	uint32_t scan(int fd, uint32_t& end);
+	void replay(int fd);
+	void writeHead(int fd);
+	void settle(int fd);
+
+	public:
+	bool on;
+	uint32_t dirty;
+	uint64_t commits;
+	uint64_t records;
+	uint64_t blocks;
+	uint64_t checkpoints;
+	uint64_t stalls;
+	uint64_t forced;
+
+	Journal();
+	bool open(int fd, uint32_t first);
+	void close();
+	ssize_t read(int fd, uint8_t* buff, size_t size, uint64_t offset);
+	ssize_t write(int fd, const uint8_t* buff, size_t size, uint64_t offset, bool data);
+	bool behind();
+	bool commit(int fd, bool home);
+	void finish(int fd);
+	void throttle(int fd);
+	void ordered();
+	bool pending(int fd, uint32_t first);
+};
+
+Journal journal;
+
+//wakes the commit thread early once many blocks wait
+pthread_cond_t commitWake = PTHREAD_COND_INITIALIZER;
+
+Journal::Journal(){
+	on = false;
+	entries = NULL;
+	pthread_mutex_init(&lock, NULL);
+	pthread_mutex_init(&io, NULL);
+}
+
+//the newest entry for block, the journal lock must be held
+jblock* Journal::find(uint32_t block){
+
+	uint32_t at = buckets[block & (JENTRIES-1)];
+
+	while(at != 0 && entries[at-1].block != block){
+		at = entries[at-1].next;
+	}
+	return at != 0 ? entries+at-1 : NULL;
+}
+
+/*
+	an entry for block that may be changed, copied from the newest version.
+	whole skips reading a block that is about to be overwritten. NULL when
+	a commit has to make room first
+*/
+jblock* Journal::take(int fd, uint32_t block, bool whole){
+
+	jblock* entry = find(block);
+	jblock* old = entry;
+	uint32_t at;
+
+	if(entry != NULL && !entry->flushing){
+		if(!entry->dirty){
+			if(dirty >= JDIRTYMAX){
+				return NULL;
+			}
+			entry->dirty = true;
+			dirty++;
+		}
+		return entry;
+	}
+	if(dirty >= JDIRTYMAX || freeList == 0){
+		return NULL;
+	}
+
+	at = freeList;
+	entry = entries+at-1;
+	freeList = entry->next;
+	entry->block = block;
+	entry->used = true;
+	entry->dirty = true;
+	entry->next = buckets[block & (JENTRIES-1)];
+	buckets[block & (JENTRIES-1)] = at;
+	used++;
+	dirty++;
+
+	if(old != NULL){
+		memcpy(image(entry), image(old), BLOCKSIZE);
+	}
+	else if(!whole && pread(fd, image(entry), BLOCKSIZE, INDEX((off_t)block)) != BLOCKSIZE){
+		memset(image(entry), 0, BLOCKSIZE);
+	}
+
+	if(dirty == JDIRTYMAX/4){
+		pthread_cond_signal(&commitWake);
+	}
+	return entry;
+}
+
+ssize_t Journal::read(int fd, uint8_t* buff, size_t size, uint64_t offset){
+
+	uint64_t end = offset+size;
+	uint64_t next;
+	jblock* entry;
+
+	pthread_mutex_lock(&lock);
+	if(used == 0){
+		pthread_mutex_unlock(&lock);
+		return pread(fd, buff, size, offset);
+	}
+
+	for(; offset < end; buff += next-offset, offset = next){
+		next = std::min(INDEX((offset >> BLOCKSHIFT)+1), end);
+		if((entry = find(offset >> BLOCKSHIFT)) != NULL){
+			memcpy(buff, image(entry)+(offset & (BLOCKSIZE-1)), next-offset);
+		}
+		else if(pread(fd, buff, next-offset, offset) != (ssize_t)(next-offset)){
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return size;
+}
+
+/*
+	metadata goes to the entry for its block. file data is written straight
+	home unless its block already has an entry, which then takes it too
+*/
+ssize_t Journal::write(int fd, const uint8_t* buff, size_t size, uint64_t offset, bool data){
+
+	uint64_t end = offset+size;
+	uint64_t next;
+	jblock* entry;
+
+	pthread_mutex_lock(&lock);
+	while(offset < end){
+		next = std::min(INDEX((offset >> BLOCKSHIFT)+1), end);
+
+		if(data && find(offset >> BLOCKSHIFT) == NULL){
+			if(pwrite(fd, buff, next-offset, offset) != (ssize_t)(next-offset)){
+				pthread_mutex_unlock(&lock);
+				return -1;
+			}
+		}
+		else if((entry = take(fd, offset >> BLOCKSHIFT, next-offset == BLOCKSIZE)) != NULL){
+			memcpy(image(entry)+(offset & (BLOCKSIZE-1)), buff, next-offset);
+		}
+		else{
+
+			//the operations under way changed more than the journal takes, they can only be committed in parts
+			pthread_mutex_unlock(&lock);
+			forced++;
+			commit(fd, true);
+			finish(fd);
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+		buff += next-offset;
+		offset = next;
+	}
+	pthread_mutex_unlock(&lock);
+	return size;
+}
+
+//the checksum of a record covers its head with the sum left out, then its blocks
+static uint64_t headSum(const uint8_t* head){
+
+	jrecHead copy = *((jrecHead*)head);
+
+	copy.sum = 0;
+	return checksum(head+sizeof(jrecHead), BLOCKSIZE-sizeof(jrecHead), checksum((uint8_t*)&copy, sizeof(jrecHead)));
+}
+
+/*
+	writes every block changed since the last commit to the journal, one or
+	more records that recovery takes all or nothing. with home, or when the
+	journal could not take another commit, every entry is also set to be
+	written home. the caller holds fslock alone, so no operation is half
+	done. finish does the waiting and must follow, a checkpoint another commit
+	left for its finish is carried out first. returns whether anything was
+	written
+*/
+bool Journal::commit(int fd, bool home){
+
+	jrecHead* head = (jrecHead*)record;
+	uint32_t* list = (uint32_t*)(record+sizeof(jrecHead));
+	uint32_t count = 0;
+	uint32_t done;
+	uint32_t n;
+
+	pthread_mutex_lock(&io);
+	if(ckpt){
+		settle(fd);
+	}
+
+	pthread_mutex_lock(&lock);
+
+	//preallocated blocks must be on disk before a record linking them can be
+	if(order && fdatasync(fd) != 0){
+		perror("failed to sync preallocated blocks");
+	}
+	order = false;
+
+	for(uint32_t i = 0; i < JENTRIES; i++){
+		if(entries[i].used && entries[i].dirty){
+			batch[count++] = i;
+			entries[i].dirty = false;
+		}
+	}
+	dirty = 0;
+
+	for(done = 0; done < count; done += n){
+		n = std::min((uint32_t)JDESC, count-done);
+		memset(record, 0, BLOCKSIZE);
+		head->magic = JRECMAGIC;
+		head->seq = seq++;
+		head->count = n;
+		head->more = done+n < count;
+		for(uint32_t i = 0; i < n; i++){
+			list[i] = entries[batch[done+i]].block;
+		}
+
+		head->sum = headSum(record);
+		for(uint32_t i = 0; i < n; i++){
+			head->sum = checksum(image(entries+batch[done+i]), BLOCKSIZE, head->sum);
+		}
+
+		rawwrite(fd, record, BLOCKSIZE, INDEX((off_t)start+pos), "failed to write journal record\n");
+		for(uint32_t i = 0; i < n; i++){
+			rawwrite(fd, image(entries+batch[done+i]), BLOCKSIZE, INDEX((off_t)start+pos+1+i), "failed to write journal record\n");
+		}
+		pos += 1+n;
+		records++;
+	}
+	blocks += count;
+	if(count > 0){
+		wrote = true;
+		commits++;
+	}
+
+	//everything in memory is committed now, so all of it can go home
+	ckpt = home || pos + JMAXREC > JOURNALBLOCKS-1;
+	if(ckpt){
+		for(uint32_t i = 0; i < JENTRIES; i++){
+			entries[i].flushing = entries[i].used;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&io);
+	return count > 0;
+}
+
+/*
+	makes the commits so far durable and carries out a checkpoint one of
+	them set up. fslock is not held, operations can go on changing blocks
+	in new entries
+*/
+void Journal::finish(int fd){
+
+	pthread_mutex_lock(&io);
+	settle(fd);
+	pthread_mutex_unlock(&io);
+}
+
+//what finish does, io must be held
+void Journal::settle(int fd){
+
+	uint32_t* link;
+
+	if(wrote && fdatasync(fd) != 0){
+		perror("failed to sync journal");
+	}
+
+	if(ckpt){
+
+		//flushing only changes with io held and is never set on a free entry, operations taking entries leave it alone
+		for(uint32_t i = 0; i < JENTRIES; i++){
+			if(entries[i].flushing){
+				rawwrite(fd, image(entries+i), BLOCKSIZE, INDEX((off_t)entries[i].block), "failed to checkpoint journal\n");
+			}
+		}
+		if(fdatasync(fd) != 0){
+			perror("failed to sync checkpoint");
+		}
+
+		//the journal only starts over once its blocks are home for good
+		pos = 1;
+		writeHead(fd);
+
+		pthread_mutex_lock(&lock);
+		for(uint32_t b = 0; b < JENTRIES; b++){
+			for(link = buckets+b; *link != 0;){
+				jblock* entry = entries+*link-1;
+				if(entry->flushing){
+					uint32_t at = *link;
+					*link = entry->next;
+					entry->used = false;
+					entry->flushing = false;
+					entry->next = freeList;
+					freeList = at;
+					used--;
+				}
+				else{
+					link = &(entry->next);
+				}
+			}
+		}
+		pthread_mutex_unlock(&lock);
+		checkpoints++;
+	}
+	wrote = false;
+	ckpt = false;
+}
+
+//raw writes to blocks taken from the end of the image, ordered before the next commit
+void Journal::ordered(){
+
+	pthread_mutex_lock(&lock);
+	order = true;
+	pthread_mutex_unlock(&lock);
+}
+
+//whether so much waits for a commit that operations should commit before they start
+bool Journal::behind(){
+
+	bool late;
+
+	if(!on){
+		return false;
+	}
+	pthread_mutex_lock(&lock);
+	late = dirty >= JDIRTYMAX/2;
+	pthread_mutex_unlock(&lock);
+	return late;
+}
+
+/*
+	an operation that finds the commit thread falling behind commits before
+	it starts, so commits keep falling between operations. fslock is held
+	alone, finish follows once it is dropped
+*/
+void Journal::throttle(int fd){
+
+	if(behind()){
+		stalls++;
+		commit(fd, false);
+	}
+}
+
+//records from seq on are the live part of the journal
+void Journal::writeHead(int fd){
+
+	journalHead jhead = {JOURNAL_NUM, seq};
+
+	rawwrite(fd, &jhead, sizeof(journalHead), INDEX((off_t)start), "failed to write journal head\n");
+	if(fdatasync(fd) != 0){
+		perror("failed to sync journal head");
+	}
+}
+
+/*
+	walks the records from the start of the journal. returns the position
+	past the last complete commit and leaves its next sequence number in end
+*/
+uint32_t Journal::scan(int fd, uint32_t& end){
+
+	jrecHead* head = (jrecHead*)record;
+	uint32_t at = 1;
+	uint32_t valid = 1;
+	uint64_t sum;
+
+	end = seq;
+	for(uint32_t next = seq;; next++){
+		if(pread(fd, record, BLOCKSIZE, INDEX((off_t)start+at)) != BLOCKSIZE){
+			break;
+		}
+		if(head->magic != JRECMAGIC || head->seq != next || head->count == 0 || head->count > JDESC || at+1+head->count > JOURNALBLOCKS-1){
+			break;
+		}
+
+		sum = headSum(record);
+		for(uint32_t i = 0; i < head->count; i++){
+			if(pread(fd, data, BLOCKSIZE, INDEX((off_t)start+at+1+i)) != BLOCKSIZE){
+				return valid;
+			}
+			sum = checksum(data, BLOCKSIZE, sum);
+		}
+		if(sum != head->sum){
+			break;
+		}
+
+		at += 1+head->count;
+		if(!head->more){
+			valid = at;
+			end = next+1;
+		}
+	}
+	return valid;
+}
+
+/*
+	writes the blocks of every complete commit home, in order. the sequence
+	numbers then jump past anything a torn commit could have left behind
+*/
+void Journal::replay(int fd){
+
+	jrecHead* head = (jrecHead*)record;
+	uint32_t* list = (uint32_t*)(record+sizeof(jrecHead));
+	uint32_t end;
+	uint32_t valid = scan(fd, end);
+	uint32_t replayed = 0;
+
+	for(uint32_t at = 1; at < valid; at += 1+head->count){
+		dread(fd, record, BLOCKSIZE, INDEX((off_t)start+at), "failed to read journal record\n");
+		for(uint32_t i = 0; i < head->count; i++){
+			dread(fd, data, BLOCKSIZE, INDEX((off_t)start+at+1+i), "failed to read journal record\n");
+			rawwrite(fd, data, BLOCKSIZE, INDEX((off_t)list[i]), "failed to replay journal\n");
+			replayed++;
+		}
+	}
+	if(replayed > 0){
+		if(fdatasync(fd) != 0){
+			perror("failed to sync replayed journal");
+		}
+		fprintf(stderr, "replayed %u journal blocks\n", replayed);
+	}
+
+	seq = end + JOURNALBLOCKS;
+	pos = 1;
+	writeHead(fd);
+}
+
+//replays the journal at first and starts keeping changes in memory. false if out of memory
+bool Journal::open(int fd, uint32_t first){
+
+	journalHead jhead;
+
+	entries = (jblock*)calloc(JENTRIES, sizeof(jblock));
+	buckets = (uint32_t*)calloc(JENTRIES, sizeof(uint32_t));
+	batch = (uint32_t*)malloc(JDIRTYMAX*sizeof(uint32_t));
+	record = (uint8_t*)malloc(BLOCKSIZE);
+	data = (uint8_t*)malloc((uint64_t)JENTRIES*BLOCKSIZE);
+	if(entries == NULL || buckets == NULL || batch == NULL || record == NULL || data == NULL){
+		close();
+		return false;
+	}
+
+	for(uint32_t i = 0; i < JENTRIES; i++){
+		entries[i].next = i+2 <= JENTRIES ? i+2 : 0;
+	}
+	freeList = 1;
+	used = 0;
+	dirty = 0;
+	wrote = false;
+	ckpt = false;
+	order = false;
+	start = first;
+	commits = records = blocks = checkpoints = stalls = forced = 0;
+
+	dread(fd, &jhead, sizeof(journalHead), INDEX((off_t)start), "failed to read journal head\n");
+	seq = jhead.seq;
+	replay(fd);
+
+	on = true;
+	return true;
+}
+
+//whether a crash left commits that a mount would replay, nothing is written
+bool Journal::pending(int fd, uint32_t first){
+
+	journalHead jhead;
+	uint32_t end;
+	bool found = true;
+
+	record = (uint8_t*)malloc(BLOCKSIZE);
+	data = (uint8_t*)malloc(BLOCKSIZE);
+	if(record != NULL && data != NULL){
+		start = first;
+		dread(fd, &jhead, sizeof(journalHead), INDEX((off_t)start), "failed to read journal head\n");
+		seq = jhead.seq;
+		found = scan(fd, end) > 1;
+	}
+	free(record);
+	free(data);
+	record = NULL;
+	data = NULL;
+	return found;
+}
+
+//everything must have been checkpointed
+void Journal::close(){
+
+	on = false;
+	free(entries);
+	free(buckets);
+	free(batch);
+	free(record);
+	free(data);
+	entries = NULL;
+}
+
+/*
+	sets aside the journal region at the end of the image. the head and
+	trailer blocks are typed so the region never looks like free tail
+*/
+bool journalCreate(int fd){
+
+	journalHead jhead = {JOURNAL_NUM, 1};
+	uint32_t first;
+
+	if((first = ncache.takeTail(fd, JOURNALBLOCKS)) == 0){
+		return false;
+	}
+	dwrite(fd, &jhead, sizeof(journalHead), INDEX((off_t)first), "failed to write journal head\n");
+	dwrite(fd, &jhead, TYPECODESIZE, INDEX((off_t)first+JOURNALBLOCKS-1), "failed to write journal trailer\n");
+	if(fdatasync(fd) != 0){
+		perror("failed to sync journal");
+	}
+
+	sext.journalStart = first;
+	sext.journalBlocks = JOURNALBLOCKS;
+	sext.features |= JOURNALFEATURE;
+	dwrite(fd, &sext, sizeof(superExt), EXTDEX, "failed to write superblock extension\n");
+	return true;
+}
+
+static int journalStats(char* buff, size_t size){
+	return snprintf(buff, size, "journal %lu commits %lu records %lu blocks %lu checkpoints %lu stalls %lu forced\n", journal.commits, journal.records, journal.blocks, journal.checkpoints, journal.stalls, journal.forced);
+}
+
+/**************************************************************
+send and receive
+**************************************************************/
+
+/*
+	every block written is given the current epoch in the epoch table, once
+	per epoch. a send streams the blocks written in a later epoch than the one
+	it starts from and moves on to the next epoch, so the next send only
+	carries what changed since. the table blocks are blocks like any other
+	and go along, a replica can be sent from in turn
+*/
+struct streamHead{
+	uint32_t magic;
+	uint32_t blockShift;
+
+	//epoch the replica has to be at, 0 for all of the image, and the one it is at after
+	uint32_t from;
+	uint32_t to;
+
+	//length of the image in blocks
+	uint32_t blocks;
+};
+
+class Epochs{
+	private:
+	uint32_t* epochs;
+	uint32_t* tables;
+	uint32_t tableCount;
+	uint32_t tableRoom;
+
+	//entries and table blocks, never held while writing
+	pthread_mutex_t lock;
+
+	uint32_t grow(int fd);
+	void link(int fd, uint32_t block_num, uint32_t prev);
+
+	public:
+	bool on;
+	uint64_t marked;
+	uint64_t sent;
+
+	Epochs();
+	uint32_t of(uint32_t block_num){return block_num < tableCount*EPOCHSPAN ? epochs[block_num] : 0;}
+	bool load(int fd);
+	bool mark(int fd, uint64_t offset, size_t size);
+	int stats(char* buff, size_t size);
+};
+
+Epochs epochs;
+
+Epochs::Epochs(){
+	epochs = NULL;
+	tables = NULL;
+	tableCount = 0;
+	tableRoom = 0;
+	on = false;
+	marked = 0;
+	sent = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+/*
+	one more table block from the end of the image, its epochs start at 0.
+	the lock must be held, the block is written by link once it is dropped
+*/
+uint32_t Epochs::grow(int fd){
+
+	uint32_t block_num;
+
+	if(tableCount == tableRoom){
+		tableRoom = tableRoom != 0 ? tableRoom*2 : 16;
+		tables = (uint32_t*)realloc(tables, tableRoom*sizeof(uint32_t));
+		epochs = (uint32_t*)realloc(epochs, (uint64_t)tableRoom*EPOCHSPAN*sizeof(uint32_t));
+		if(tables == NULL || epochs == NULL){
+			perror("failed to allocate epoch table");
+			exit(-1);
+		}
+	}
+
+	if((block_num = ncache.takeTail(fd, 1)) == 0){
+		fprintf(stderr, "no room left for the epoch table\n");
+		exit(-1);
+	}
+	memset(epochs+(uint64_t)tableCount*EPOCHSPAN, 0, EPOCHSPAN*sizeof(uint32_t));
+	tables[tableCount++] = block_num;
+	return block_num;
+}
+
+//writes a table block grow added and links it behind prev, its own entry gets marked by the first write
+void Epochs::link(int fd, uint32_t block_num, uint32_t prev){
+
+	uint32_t kind = EPOCH_NUM;
+
+	dwrite(fd, &kind, TYPECODESIZE, INDEX(block_num), "failed to start epoch table block\n");
+	if(prev == 0){
+		sext.epochHead = block_num;
+		dwrite(fd, &(sext.epochHead), BNUMSIZE, EXTDEX+offsetof(superExt, epochHead), "failed to record epoch table\n");
+	}
+	else{
+		ncache.setNext(fd, prev, block_num);
+	}
+}
+
+//reads the whole table, false if a block of it is damaged
+bool Epochs::load(int fd){
+
+	uint8_t block[BLOCKSIZE];
+
+	if(!(sext.features & SENDFEATURE)){
+		return true;
+	}
+
+	for(uint32_t b = sext.epochHead; b != 0; b = *((uint32_t*)(block+BLOCKSIZE-BNUMSIZE))){
+		dread(fd, block, BLOCKSIZE, INDEX(b), "failed to read epoch table\n");
+		if(*((uint32_t*)block) != EPOCH_NUM){
+			return false;
+		}
+		if(tableCount == tableRoom){
+			tableRoom = tableRoom != 0 ? tableRoom*2 : 16;
+			tables = (uint32_t*)realloc(tables, tableRoom*sizeof(uint32_t));
+			epochs = (uint32_t*)realloc(epochs, (uint64_t)tableRoom*EPOCHSPAN*sizeof(uint32_t));
+			if(tables == NULL || epochs == NULL){
+				perror("failed to allocate epoch table");
+				exit(-1);
+			}
+		}
+		memcpy(epochs+(uint64_t)tableCount*EPOCHSPAN, block+TYPECODESIZE, EPOCHSPAN*sizeof(uint32_t));
+		tables[tableCount++] = b;
+	}
+	on = true;
+	return true;
+}
+
+/*
+	gives the blocks of a write the current epoch. returns whether any were
+	behind, the write then has to be journaled along with their entries so a
+	crash can't keep the write and lose the mark. the entries change under
+	the lock a run at a time, writing them happens after it is dropped since
+	those writes come back through here and through the snapshots. every
+	entry in a run is the current epoch by then, so runs written out of
+	order still agree
+*/
+bool Epochs::mark(int fd, uint64_t offset, size_t size){
+
+	uint32_t current[EPOCHRUN];
+	uint32_t block_num;
+	uint32_t last;
+	uint32_t end;
+	uint32_t from;
+	uint32_t added;
+	uint32_t prev;
+	uint32_t table = 0;
+	bool behind = false;
+
+	if(!on || size == 0){
+		return false;
+	}
+
+	last = (offset+size-1) >> BLOCKSHIFT;
+	for(block_num = offset >> BLOCKSHIFT; block_num <= last; ){
+		added = 0;
+		prev = 0;
+
+		pthread_mutex_lock(&lock);
+		if(block_num >= tableCount*EPOCHSPAN){
+			prev = tableCount != 0 ? tables[tableCount-1] : 0;
+			added = grow(fd);
+			from = block_num;
+		}
+		else{
+			//a run of behind entries in one table block, short enough for one write
+			end = std::min(last+1, (block_num/EPOCHSPAN+1)*EPOCHSPAN);
+			for(; block_num < end && epochs[block_num] == sext.epoch; block_num++);
+			end = std::min(end, block_num+EPOCHRUN);
+			for(from = block_num; block_num < end && epochs[block_num] != sext.epoch; block_num++){
+				epochs[block_num] = sext.epoch;
+			}
+			table = tables[from/EPOCHSPAN];
+			marked += block_num-from;
+		}
+		pthread_mutex_unlock(&lock);
+
+		if(added != 0){
+			link(fd, added, prev);
+		}
+		if(block_num > from){
+			for(uint32_t i = 0; i < block_num-from; i++){
+				current[i] = sext.epoch;
+			}
+			dwrite(fd, current, (block_num-from)*BNUMSIZE, INDEX(table)+TYPECODESIZE+(from%EPOCHSPAN)*BNUMSIZE, "failed to write block epoch\n");
+			behind = true;
+		}
+	}
+	return behind;
+}
+
+int Epochs::stats(char* buff, size_t size){
+	return snprintf(buff, size, "epoch %u, %u table blocks, %lu marked %lu sent\n", sext.epoch, tableCount, marked, sent);
+}
+
+/*
+	streams the image blocks written after epoch from, or every block when
+	from is 0, then starts a new epoch. the stream goes to path and its
+	checksum goes last so a receiver can tell it arrived whole
+*/
+static void sendStream(int fd, const char* path, uint32_t from){
+
+	uint8_t block[BLOCKSIZE];
+	streamHead head = {STREAMMAGIC, BLOCKSHIFT, from, sext.epoch, 0};
+	uint32_t end = STREAMEND;
+	uint64_t sum;
+	FILE* out;
+	bool ok;
+
+	if(from >= sext.epoch){
+		fprintf(stderr, "image is at epoch %u, nothing was sent after %u\n", sext.epoch, from);
+		exit(-1);
+	}
+	if((out = fopen(path, "wb")) == NULL){
+		perror("failed to open send stream");
+		exit(-1);
+	}
+
+	//what the journal holds goes home, so its region reads as empty wherever it lands
+	if(journal.on){
+		journal.commit(fd, true);
+		journal.finish(fd);
+	}
+
+	head.blocks = ncache.usedBlocks(fd);
+	sum = checksum((uint8_t*)&head, sizeof(streamHead));
+	ok = fwrite(&head, sizeof(streamHead), 1, out) == 1;
+
+	for(uint32_t b = 0; ok && b < head.blocks; b++){
+		if(from != 0 && epochs.of(b) <= from){
+			continue;
+		}
+		dread(fd, block, BLOCKSIZE, INDEX(b), "failed to read block to send\n");
+		sum = checksum((uint8_t*)&b, BNUMSIZE, sum);
+		sum = checksum(block, BLOCKSIZE, sum);
+		ok = fwrite(&b, BNUMSIZE, 1, out) == 1 && fwrite(block, BLOCKSIZE, 1, out) == 1;
+		epochs.sent++;
+	}
+
+	//a short stream must not start a new epoch, the blocks it missed would never be sent
+	ok = ok && fwrite(&end, BNUMSIZE, 1, out) == 1 && fwrite(&sum, sizeof(sum), 1, out) == 1;
+	if(fclose(out) != 0 || !ok){
+		perror("failed to write send stream");
+		exit(-1);
+	}
+
+	//everything from here on is for the next send
+	sext.epoch++;
+	dwrite(fd, &(sext.epoch), BNUMSIZE, EXTDEX+offsetof(superExt, epoch), "failed to start a new epoch\n");
+	fprintf(stderr, "sent %lu blocks from epoch %u, next send from %u\n", epochs.sent, from, head.to);
+}
+
+/*
+	applies a stream to the image at fd. the superblock goes last, only once
+	the checksum matches, so a replica left behind by a broken stream still
+	takes the same stream again
+*/
+static void receiveStream(int fd, const char* path){
+
+	uint8_t block[BLOCKSIZE];
+	uint8_t first[BLOCKSIZE];
+	bool haveFirst = false;
+	streamHead head;
+	superExt ext;
+	uint32_t b = 0;
+	uint64_t sum;
+	uint64_t want;
+	uint64_t received = 0;
+	FILE* in;
+
+	if((in = fopen(path, "rb")) == NULL){
+		perror("failed to open receive stream");
+		exit(-1);
+	}
+	if(fread(&head, sizeof(streamHead), 1, in) != 1 || head.magic != STREAMMAGIC){
+		fprintf(stderr, "not a send stream\n");
+		exit(-1);
+	}
+	if(head.blockShift != BLOCKSHIFT){
+		fprintf(stderr, "stream has %u byte blocks, this build uses %u\n", 1u<<head.blockShift, BLOCKSIZE);
+		exit(-1);
+	}
+
+	//an incremental stream only applies on top of the send before it
+	if(head.from != 0){
+		if(pread(fd, &ext, sizeof(superExt), EXTDEX) != sizeof(superExt) || ext.magic != EXTMAGIC || !(ext.features & SENDFEATURE)){
+			fprintf(stderr, "image is no replica, receive a full stream first\n");
+			exit(-1);
+		}
+		if(ext.epoch != head.from){
+			fprintf(stderr, "replica is at epoch %u, stream starts from %u\n", ext.epoch, head.from);
+			exit(-1);
+		}
+	}
+	sum = checksum((uint8_t*)&head, sizeof(streamHead));
+
+	if(ftruncate(fd, INDEX((off_t)head.blocks)) != 0){
+		perror("failed to size replica");
+		exit(-1);
+	}
+
+	while(fread(&b, BNUMSIZE, 1, in) == 1 && b != STREAMEND){
+		if(b >= head.blocks || fread(block, BLOCKSIZE, 1, in) != 1){
+			break;
+		}
+		sum = checksum((uint8_t*)&b, BNUMSIZE, sum);
+		sum = checksum(block, BLOCKSIZE, sum);
+		if(b == SUPERBLOCK){
+			memcpy(first, block, BLOCKSIZE);
+			haveFirst = true;
+		}
+		else{
+			rawwrite(fd, block, BLOCKSIZE, INDEX((off_t)b), "failed to write received block\n");
+		}
+		received++;
+	}
+
+	if(b != STREAMEND || fread(&want, sizeof(want), 1, in) != 1 || want != sum){
+		fprintf(stderr, "send stream is damaged or cut short, the replica needs it again\n");
+		exit(-1);
+	}
+	fclose(in);
+
+	if(fdatasync(fd) != 0){
+		perror("failed to sync received blocks");
+	}
+	if(haveFirst){
+		rawwrite(fd, first, BLOCKSIZE, INDEX(SUPERBLOCK), "failed to write received superblock\n");
+		if(fdatasync(fd) != 0){
+			perror("failed to sync received superblock");
+		}
+	}
+	fprintf(stderr, "received %lu blocks, replica at epoch %u\n", received, head.to);
+}
+
+/**************************************************************
+snapshots
+**************************************************************/
+
+/*
+	a snapshot is the image as it was when it was taken. taking one only
+	records its generation and how far the image reached. after that the
+	first change to a block the snapshot still shares copies the block to
+	the end of the image, and the map of the newest snapshot records where
+	the copy went. a snapshot reads a block from the first of its own and
+	the newer maps that has it, and from the live image when none does.
+	freed chains carry the generation they were freed in, so a block handed
+	out again is only copied when some snapshot can still see it
+*/
+struct snapEntry{
+	uint32_t gen;
+
+	//blocks the image had, none past them belong to the snapshot
+	uint32_t blocks;
+
+	//newest block of the map chain, linked through the regular next pointers
+	uint32_t mapHead;
+	uint32_t taken;
+};
+
+struct snapTable{
+	uint32_t typeCode;
+	uint32_t count;
+
+	//oldest first
+	snapEntry entries[SNAPMAX];
+};
+
+//block and copy pairs follow, a copy of 0 marks a block no snapshot needs
+struct snapMapHead{
+	uint32_t typeCode;
+	uint32_t count;
+};
+
+//the pairs of one snapshot in memory, open addressing on block+1 so the superblock fits
+struct snapMap{
+	uint32_t* keys;
+	uint32_t* vals;
+	uint32_t size;
+	uint32_t count;
+};
+
+class Snapshots{
+	private:
+	snapTable table;
+	snapMap maps[SNAPMAX];
+	uint32_t mapCount[SNAPMAX];
+
+	//index+1 of the snapshot mounted instead of the live image
+	uint32_t view;
+
+	//writes made for snapshots are not copied for them
+	bool busy;
+
+	//the copies and maps of writers going at once, recursive since the writes of a copy come back through preserve
+	pthread_mutex_t lock;
+
+	bool find(uint32_t i, uint32_t block_num, uint32_t& copy);
+	void put(uint32_t i, uint32_t block_num, uint32_t copy);
+	uint32_t grab(int fd);
+	void writeTable(int fd);
+	void record(int fd, uint32_t i, uint32_t block_num, uint32_t copy);
+	void copy(int fd, uint32_t block_num);
+	void forget(int fd, uint32_t block_num);
+
+	public:
+	uint64_t copies;
+	uint64_t claims;
+
+	Snapshots();
+	uint32_t count(){return table.count;}
+	bool viewing(){return view != 0;}
+	bool load(int fd);
+	void take(int fd);
+	bool drop(int fd, uint32_t gen);
+	bool mount(uint32_t gen);
+	bool preserve(int fd, uint64_t offset, size_t size);
+	void claim(int fd, uint32_t block_num, uint32_t freed);
+	ssize_t read(int fd, uint8_t* buff, size_t size, uint64_t offset);
+	int stats(char* buff, size_t size);
+};
+
+Snapshots snaps;
+
+Snapshots::Snapshots(){
+	memset(&table, 0, sizeof(table));
+	memset(maps, 0, sizeof(maps));
+	pthread_mutexattr_t attr;
+
+	view = 0;
+	busy = false;
+	copies = 0;
+	claims = 0;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static uint32_t mapSlot(const snapMap* map, uint32_t block_num){
+
+	uint32_t at = (block_num * 0x9E3779B1u) & (map->size-1);
+
+	while(map->keys[at] != 0 && map->keys[at] != block_num+1){
+		at = (at+1) & (map->size-1);
+	}
+	return at;
+}
+
+bool Snapshots::find(uint32_t i, uint32_t block_num, uint32_t& copy){
+
+	uint32_t at;
+
+	if(maps[i].size == 0 || maps[i].keys[at = mapSlot(maps+i, block_num)] == 0){
+		return false;
+	}
+	copy = maps[i].vals[at];
+	return true;
+}
+
+//adds a pair in memory, the map doubles once it is three quarters full
+void Snapshots::put(uint32_t i, uint32_t block_num, uint32_t copy){
+
+	snapMap* map = maps+i;
+	snapMap grown;
+	uint32_t at;
+
+	if((map->count+1)*4 > map->size*3){
+		grown.size = map->size != 0 ? map->size*2 : 1024;
+		grown.count = map->count;
+		grown.keys = (uint32_t*)calloc(grown.size, sizeof(uint32_t));
+		grown.vals = (uint32_t*)malloc(grown.size*sizeof(uint32_t));
+		if(grown.keys == NULL || grown.vals == NULL){
+			perror("failed to allocate snapshot map");
+			exit(-1);
+		}
+		for(uint32_t j = 0; j < map->size; j++){
+			if(map->keys[j] != 0){
+				at = mapSlot(&grown, map->keys[j]-1);
+				grown.keys[at] = map->keys[j];
+				grown.vals[at] = map->vals[j];
+			}
+		}
+		free(map->keys);
+		free(map->vals);
+		*map = grown;
+	}
+
+	at = mapSlot(map, block_num);
+	if(map->keys[at] == 0){
+		map->keys[at] = block_num+1;
+		map->count++;
+	}
+	map->vals[at] = copy;
+}
+
+//a block from the end of the image, remembered in the superblock since a copy may look like tail
+uint32_t Snapshots::grab(int fd){
+
+	uint32_t block_num;
+
+	if((block_num = ncache.takeTail(fd, 1)) == 0){
+		fprintf(stderr, "no room left for snapshot copies\n");
+		exit(-1);
+	}
+	sext.snapEnd = block_num+1;
+	dwrite(fd, &(sext.snapEnd), BNUMSIZE, EXTDEX+offsetof(superExt, snapEnd), "failed to update snapshot end\n");
+	return block_num;
+}
+
+void Snapshots::writeTable(int fd){
+	dwrite(fd, &table, (ssize_t)(offsetof(snapTable, entries)+table.count*sizeof(snapEntry)), INDEX(sext.snapTable), "failed to write snapshot table\n");
+}
+
+//adds a pair to the map of snapshot i, the pair goes before the count that takes it in
+void Snapshots::record(int fd, uint32_t i, uint32_t block_num, uint32_t copy){
+
+	snapEntry* snap = table.entries+i;
+	snapMapHead head = {SNAPMAP_NUM, 0};
+	uint32_t pair[2] = {block_num, copy};
+	uint32_t mapBlock;
+	bool was = busy;
+
+	busy = true;
+	if(snap->mapHead == 0 || mapCount[i] == MAPPAIRS){
+		mapBlock = grab(fd);
+		dwrite(fd, &head, sizeof(snapMapHead), INDEX(mapBlock), "failed to start snapshot map\n");
+		ncache.setNext(fd, mapBlock, snap->mapHead);
+		snap->mapHead = mapBlock;
+		mapCount[i] = 0;
+		writeTable(fd);
+	}
+
+	dwrite(fd, pair, 2*BNUMSIZE, INDEX(snap->mapHead)+sizeof(snapMapHead)+mapCount[i]*2*BNUMSIZE, "failed to extend snapshot map\n");
+	mapCount[i]++;
+	dwrite(fd, &(mapCount[i]), BNUMSIZE, INDEX(snap->mapHead)+offsetof(snapMapHead, count), "failed to extend snapshot map\n");
+	busy = was;
+
+	put(i, block_num, copy);
+}
+
+//gives the newest snapshot the block as it is now
+void Snapshots::copy(int fd, uint32_t block_num){
+
+	uint8_t data[BLOCKSIZE];
+	uint32_t at = grab(fd);
+
+	dread(fd, data, BLOCKSIZE, INDEX(block_num), "failed to read block for snapshot\n");
+	dwrite(fd, data, BLOCKSIZE, INDEX(at), "failed to copy block for snapshot\n");
+	record(fd, table.count-1, block_num, at);
+	copies++;
+}
+
+//a block snapshots used for themselves is no one's once freed
+void Snapshots::forget(int fd, uint32_t block_num){
+
+	uint32_t copy;
+
+	if(table.count != 0 && block_num < table.entries[table.count-1].blocks && !find(table.count-1, block_num, copy)){
+		record(fd, table.count-1, block_num, 0);
+	}
+}
+
+/*
+	reads the table and every map. only once the journal has put everything
+	home. false if the table is damaged
+*/
+bool Snapshots::load(int fd){
+
+	uint8_t block[BLOCKSIZE];
+	snapMapHead* head = (snapMapHead*)block;
+	uint32_t* pairs = (uint32_t*)(block+sizeof(snapMapHead));
+
+	if(!(sext.features & SNAPFEATURE) || sext.snapTable == 0){
+		return true;
+	}
+
+	dread(fd, &table, sizeof(snapTable), INDEX(sext.snapTable), "failed to read snapshot table\n");
+	if(table.typeCode != SNAP_NUM || table.count > SNAPMAX){
+		table.count = 0;
+		return false;
+	}
+
+	for(uint32_t i = 0; i < table.count; i++){
+		mapCount[i] = 0;
+		for(uint32_t m = table.entries[i].mapHead; m != 0; m = *((uint32_t*)(block+BLOCKSIZE-BNUMSIZE))){
+			dread(fd, block, BLOCKSIZE, INDEX(m), "failed to read snapshot map\n");
+			if(head->typeCode != SNAPMAP_NUM || head->count > MAPPAIRS){
+				table.count = 0;
+				return false;
+			}
+			if(m == table.entries[i].mapHead){
+				mapCount[i] = head->count;
+			}
+			for(uint32_t p = 0; p < head->count; p++){
+				put(i, pairs[2*p], pairs[2*p+1]);
+			}
+		}
+	}
+	return true;
+}
+
+//constant time, what the snapshot shares is copied as it changes
+void Snapshots::take(int fd){
+
+	snapEntry* snap = table.entries+table.count;
+	uint32_t blocks = ncache.usedBlocks(fd);
+
+	if(table.count == SNAPMAX){
+		fprintf(stderr, "already %d snapshots, drop one first\n", SNAPMAX);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	busy = true;
+	if(!(sext.features & SNAPFEATURE)){
+		sext.snapTable = 0;
+		sext.snapGen = 0;
+		sext.snapEnd = 0;
+		sext.features |= SNAPFEATURE;
+	}
+	if(sext.snapTable == 0){
+		sext.snapTable = grab(fd);
+		table.typeCode = SNAP_NUM;
+	}
+
+	snap->gen = ++sext.snapGen;
+	snap->blocks = blocks;
+	snap->mapHead = 0;
+	snap->taken = time(NULL);
+	mapCount[table.count] = 0;
+	table.count++;
+	writeTable(fd);
+	dwrite(fd, &sext, sizeof(superExt), EXTDEX, "failed to record snapshot\n");
+	busy = false;
+	pthread_mutex_unlock(&lock);
+
+	fprintf(stderr, "took snapshot %u\n", snap->gen);
+}
+
+/*
+	pairs of the dropped snapshot go to the next older one, which used to
+	find them by looking through the newer maps. what that one already has,
+	or all of it when there is no older one, is freed
+*/
+bool Snapshots::drop(int fd, uint32_t gen){
+
+	snapMap gone;
+	uint32_t mapHead;
+	uint32_t block_num;
+	uint32_t copy;
+	uint32_t i;
+
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < table.count && table.entries[i].gen != gen; i++);
+	if(i == table.count){
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	gone = maps[i];
+	mapHead = table.entries[i].mapHead;
+	memmove(table.entries+i, table.entries+i+1, (table.count-i-1)*sizeof(snapEntry));
+	memmove(maps+i, maps+i+1, (table.count-i-1)*sizeof(snapMap));
+	memmove(mapCount+i, mapCount+i+1, (table.count-i-1)*sizeof(uint32_t));
+	table.count--;
+	memset(maps+table.count, 0, sizeof(snapMap));
+	writeTable(fd);
+
+	for(uint32_t at = 0; at < gone.size; at++){
+		if(gone.keys[at] == 0){
+			continue;
+		}
+		block_num = gone.keys[at]-1;
+		if(i > 0 && !find(i-1, block_num, copy)){
+			record(fd, i-1, block_num, gone.vals[at]);
+		}
+		else if(gone.vals[at] != 0){
+			forget(fd, gone.vals[at]);
+			ncache.release(fd, gone.vals[at]);
+		}
+	}
+
+	for(uint32_t m = mapHead; m != 0; m = ncache.getNext(fd, m)){
+		forget(fd, m);
+	}
+	if(mapHead != 0){
+		ncache.releaseChain(fd, mapHead);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	free(gone.keys);
+	free(gone.vals);
+	fprintf(stderr, "dropped snapshot %u\n", gen);
+	return true;
+}
+
+//reads go to snapshot gen from now on
+bool Snapshots::mount(uint32_t gen){
+
+	for(uint32_t i = 0; i < table.count; i++){
+		if(table.entries[i].gen == gen){
+			view = i+1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+	copies the blocks of a write the newest snapshot still shares. returns
+	whether any were, the write then has to be journaled along with the copy
+*/
+bool Snapshots::preserve(int fd, uint64_t offset, size_t size){
+
+	snapEntry* newest;
+	uint32_t copy;
+	bool copied = false;
+
+	//snapshots are only taken and dropped at mount, the count can be read without the lock
+	if(table.count == 0 || size == 0){
+		return false;
+	}
+
+	pthread_mutex_lock(&lock);
+	if(busy){
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	newest = table.entries+table.count-1;
+
+	busy = true;
+	for(uint64_t b = offset >> BLOCKSHIFT; b <= (offset+size-1) >> BLOCKSHIFT; b++){
+		if(b < newest->blocks && b != sext.snapTable && !find(table.count-1, b, copy)){
+			this->copy(fd, b);
+			copied = true;
+		}
+	}
+	busy = false;
+	pthread_mutex_unlock(&lock);
+	return copied;
+}
+
+/*
+	a free block is about to be written. freed before the oldest snapshot it
+	is no snapshot's, otherwise it is copied like any other shared block
+*/
+void Snapshots::claim(int fd, uint32_t block_num, uint32_t freed){
+
+	uint32_t copy;
+
+	if(table.count == 0 || block_num >= table.entries[table.count-1].blocks || block_num == sext.snapTable){
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	if(!busy && !find(table.count-1, block_num, copy)){
+		busy = true;
+		if(freed >= table.entries[0].gen){
+			this->copy(fd, block_num);
+		}
+		else{
+			record(fd, table.count-1, block_num, 0);
+			claims++;
+		}
+		busy = false;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+//the view is mounted read only, nothing changes the maps under it
+ssize_t Snapshots::read(int fd, uint8_t* buff, size_t size, uint64_t offset){
+
+	uint64_t end = offset+size;
+	uint64_t next;
+	uint32_t from;
+	uint32_t copy;
+
+	for(; offset < end; buff += next-offset, offset = next){
+		next = std::min(INDEX((offset >> BLOCKSHIFT)+1), end);
+		from = offset >> BLOCKSHIFT;
+		for(uint32_t i = view-1; i < table.count; i++){
+			if(find(i, offset >> BLOCKSHIFT, copy)){
+				from = copy != 0 ? copy : from;
+				break;
+			}
+		}
+		if(pread(fd, buff, next-offset, INDEX(from)+(offset & (BLOCKSIZE-1))) != (ssize_t)(next-offset)){
+			return -1;
+		}
+	}
+	return size;
+}
+
+int Snapshots::stats(char* buff, size_t size){
+
+	int len;
+
+	pthread_mutex_lock(&lock);
+	len = snprintf(buff, size, "snapshots %u, %lu copies %lu claimed\n", table.count, copies, claims);
+	for(uint32_t i = 0; i < table.count && len >= 0 && (size_t)len < size; i++){
+		len += snprintf(buff+len, size-len, "snapshot %u of %u blocks, %u preserved, taken %u\n", table.entries[i].gen, table.entries[i].blocks, maps[i].count, table.entries[i].taken);
+	}
+	pthread_mutex_unlock(&lock);
+	return len;
+}
+
+uint32_t snapCount(){
+	return snaps.count();
+}
+
+void snapClaim(int fd, uint32_t block_num, uint32_t freed){
+	snaps.claim(fd, block_num, freed);
+}
+
+ssize_t imgRead(int fd, void* buff, size_t size, uint64_t offset){
+
+	if(snaps.viewing()){
+		return snaps.read(fd, (uint8_t*)buff, size, offset);
+	}
+	return journal.on ? journal.read(fd, (uint8_t*)buff, size, offset) : pread(fd, buff, size, offset);
+}
+
+ssize_t imgWrite(int fd, const void* buff, size_t size, uint64_t offset, bool data){
+
+	//a copy taken for a snapshot goes in the same commit as the change, data included
+	if(snaps.preserve(fd, offset, size)){
+		data = false;
+	}
+
+	//so does the epoch of a block written for the first time since the last send
+	if(epochs.mark(fd, offset, size)){
+		data = false;
+	}
+	return journal.on ? journal.write(fd, (const uint8_t*)buff, size, offset, data) : pwrite(fd, buff, size, offset);
+}
+
+/*
+	nothing on disk links to a block taken from the end of the image yet, so
+	its writes skip the journal, where a run of them would take an entry per
+	block. the commit after them waits for them instead, and a crash before
+	that commit leaks the blocks rather than linking to blank ones. no
+	snapshot shares such a block, only its epoch is recorded
+*/
+ssize_t imgFresh(int fd, const void* buff, size_t size, uint64_t offset){
+
+	ssize_t len;
+
+	epochs.mark(fd, offset, size);
+	if(!journal.on){
+		return pwrite(fd, buff, size, offset);
+	}
+	len = journal.write(fd, (const uint8_t*)buff, size, offset, true);
+	journal.ordered();
+	return len;
+}
+
+/**************************************************************
+locking
+**************************************************************/
+
+/*
+	operations share fslock and only keep out of each other's way through
+	the locks of what they touch. a commit takes it alone so it never sees
+	an operation half done, as does anything that must not run beside one.
+	waiting writers go first where the library lets them, so a stream of
+	operations can't hold a commit off
+*/
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+pthread_rwlock_t fslock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+pthread_rwlock_t fslock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+/*
+	scratch memory for the operation a thread is running. handed out by
+	bumping an offset and given back all at once when the operation drops
+	fslock. requests past the end of the arena get heap chunks that go with it
+*/
+class Arena{
+	private:
+	struct chunk{
+		chunk* next;
+		uint64_t pad;
+	};
+
+	alignas(16) uint8_t base[ARENASIZE];
+	uint32_t used = 0;
+	chunk* spill = NULL;
+
+	public:
+	void* get(size_t bytes);
+	char* copy(const char* str);
+	void release();
+};
+
+void* Arena::get(size_t bytes){
+
+	chunk* extra;
+
+	bytes = (bytes + 15) & ~(size_t)15;
+	if(used + bytes <= ARENASIZE){
+		used += bytes;
+		return base + used - bytes;
+	}
+
+	if((extra = (chunk*)malloc(sizeof(chunk) + bytes)) == NULL){
+		perror("failed to grow scratch arena\n");
+		exit(-1);
+	}
+	extra->next = spill;
+	spill = extra;
+	return extra + 1;
+}
+
+char* Arena::copy(const char* str){
+
+	size_t len = strlen(str) + 1;
+
+	return (char*)memcpy(get(len), str, len);
+}
+
+void Arena::release(){
+
+	chunk* extra;
+
+	while((extra = spill) != NULL){
+		spill = extra->next;
+		free(extra);
+	}
+	used = 0;
+}
+
+//operations on other threads keep their own
+thread_local Arena scratch;
+
+//held by an operation for its whole run, never twice by one thread
+class FSLock{
+	public:
+	FSLock();
+	~FSLock(){scratch.release(); pthread_rwlock_unlock(&fslock);}
+};
+
+FSLock::FSLock(){
+
+	//with the commit thread falling behind, the operation commits before it starts
+	if(journal.behind()){
+		pthread_rwlock_wrlock(&fslock);
+		journal.throttle(fsargs.fd);
+		pthread_rwlock_unlock(&fslock);
+		journal.finish(fsargs.fd);
+	}
+	pthread_rwlock_rdlock(&fslock);
+}
+
+//fslock taken alone, for commits and for mount and unmount
+class FSExclusive{
+	public:
+	FSExclusive(){pthread_rwlock_wrlock(&fslock);}
+	~FSExclusive(){pthread_rwlock_unlock(&fslock);}
+};
+
+/*
+	asks a background thread to finish and waits for it. lock is the one it
+	checks stop under, NULL when that is fslock taken alone
+*/
+void stopWorker(pthread_t thread, bool& running, bool& stop, pthread_mutex_t* lock, pthread_cond_t* wake){
+
+	if(running){
+		if(lock != NULL){
+			pthread_mutex_lock(lock);
+		}
+		else{
+			pthread_rwlock_wrlock(&fslock);
+		}
+		stop = true;
+		if(wake != NULL){
+			pthread_cond_signal(wake);
+		}
+		if(lock != NULL){
+			pthread_mutex_unlock(lock);
+		}
+		else{
+			pthread_rwlock_unlock(&fslock);
+		}
+		pthread_join(thread, NULL);
+		running = false;
+	}
+}
+
+/**************************************************************
+lazy timestamps
+**************************************************************/
+
+/*
+	with cfs_lazytime, times set on their own wait here instead of going to
+	the image. readInode sees them, and they go out when another inode
+	wants their slot, along with the next write to the same header, on
+	fsync, every TIMEPERIOD seconds and at unmount. a crash loses only
+	the times still waiting
+*/
+struct lazyTime{
+
+	//offset of the inode, 0 when free since the superblock is no inode
+	uint64_t at;
+
+	//access, modification and status times as laid out in the inode
+	uint32_t times[TIMESBYTES/TIMESIZE];
+};
+
+static lazyTime lazyTimes[LAZYTIMES];
+
+//slots are shared by the inodes hashing to them and flushed by the timer thread
+pthread_mutex_t lazylock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t lazyDeferred = 0;
+uint64_t lazyWritten = 0;
+uint64_t lazyShared = 0;
+
+pthread_t timer;
+pthread_cond_t timerWake = PTHREAD_COND_INITIALIZER;
+bool timerRunning = false;
+bool timerStop = false;
+
+static lazyTime* lazyFor(uint64_t at){
+	return &lazyTimes[(at >> (BLOCKSHIFT-PACKSHIFT)) % LAZYTIMES];
+}
+
+//lazylock must be held
+static void lazyWrite(int fd, lazyTime* slot){
+
+	if(slot->at != 0){
+		dwrite(fd, slot->times, TIMESBYTES, slot->at+ATIMESDEX, "failed to write timestamps\n");
+		slot->at = 0;
+		lazyWritten++;
+	}
+}
+
+void lazyFlush(int fd){
+
+	pthread_mutex_lock(&lazylock);
+	for(uint32_t i = 0; i < LAZYTIMES; i++){
+		lazyWrite(fd, lazyTimes+i);
+	}
+	pthread_mutex_unlock(&lazylock);
+}
+
+//writes out the times waiting for the inode at offset, if any
+void lazySync(int fd, uint64_t at){
+
+	lazyTime* slot = lazyFor(at);
+
+	if(!fsargs.lazytime){
+		return;
+	}
+	pthread_mutex_lock(&lazylock);
+	if(slot->at == at){
+		lazyWrite(fd, slot);
+	}
+	pthread_mutex_unlock(&lazylock);
+}
+
+//puts the times waiting for the inode at offset over the ones read from the image
+void lazyApply(uint64_t at, inodeHead& inode){
+
+	lazyTime* slot = lazyFor(at);
+
+	//without cfs_lazytime the slots stay empty, reads don't need the lock
+	if(!fsargs.lazytime){
+		return;
+	}
+	pthread_mutex_lock(&lazylock);
+	if(slot->at == at){
+		memcpy(((uint8_t*)&inode)+ATIMESDEX, slot->times, TIMESBYTES);
+	}
+	pthread_mutex_unlock(&lazylock);
+}
+
+//an inode going away takes its times with it, they must not land on whatever gets the space
+void lazyDrop(uint64_t at){
+
+	lazyTime* slot = lazyFor(at);
+
+	if(!fsargs.lazytime){
+		return;
+	}
+	pthread_mutex_lock(&lazylock);
+	if(slot->at == at){
+		slot->at = 0;
+	}
+	pthread_mutex_unlock(&lazylock);
+}
+
+//sets all three times of the inode at offset, held back with cfs_lazytime
+void setTimes(int fd, uint64_t at, const uint32_t* times){
+
+	lazyTime* slot = lazyFor(at);
+
+	if(!fsargs.lazytime){
+		dwrite(fd, times, TIMESBYTES, at+ATIMESDEX, "failed to write timestamps\n");
+		return;
+	}
+	pthread_mutex_lock(&lazylock);
+	if(slot->at != at){
+		lazyWrite(fd, slot);
+		slot->at = at;
+	}
+	memcpy(slot->times, times, TIMESBYTES);
+	lazyDeferred++;
+	pthread_mutex_unlock(&lazylock);
+}
+
+/*
+	writes bytes from to to of the header of inode, which came from
+	readInode, stretched to take any times waiting for it along
+*/
+void headWrite(int fd, uint64_t at, inodeHead& inode, uint32_t from, uint32_t to, const char* msg){
+
+	lazyTime* slot = lazyFor(at);
+
+	if(!fsargs.lazytime){
+		dwrite(fd, ((uint8_t*)&inode)+from, (ssize_t)(to-from), at+from, msg);
+		return;
+	}
+
+	//the slot is only let go once the times are written, a flush in between would write older ones
+	pthread_mutex_lock(&lazylock);
+	if(slot->at == at){
+		memcpy(((uint8_t*)&inode)+ATIMESDEX, slot->times, TIMESBYTES);
+		from = std::min(from, (uint32_t)ATIMESDEX);
+		to = std::max(to, (uint32_t)(ATIMESDEX+TIMESBYTES));
+		slot->at = 0;
+		lazyShared++;
+	}
+	dwrite(fd, ((uint8_t*)&inode)+from, (ssize_t)(to-from), at+from, msg);
+	pthread_mutex_unlock(&lazylock);
+}
+
+void* timeLoop(void* unused){
+
+	struct timespec wake;
+
+	pthread_mutex_lock(&lazylock);
+	while(!timerStop){
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += TIMEPERIOD;
+		pthread_cond_timedwait(&timerWake, &lazylock, &wake);
+		for(uint32_t i = 0; i < LAZYTIMES; i++){
+			lazyWrite(fsargs.fd, lazyTimes+i);
+		}
+	}
+	pthread_mutex_unlock(&lazylock);
+
+	return NULL;
+}
+
+static int lazyStats(char* buff, size_t size){
+
+	int len;
+
+	pthread_mutex_lock(&lazylock);
+	len = snprintf(buff, size, "lazytime %lu deferred %lu written %lu shared\n", lazyDeferred, lazyWritten, lazyShared);
+	pthread_mutex_unlock(&lazylock);
+	return len;
+}
+
+/**************************************************************
+Helper functions
+**************************************************************/
+
+/*verified*/
+inodeHead readInode(int fd, uint64_t offset){
+	//fprintf(stderr,"reading Inode at offset: %d\n",offset);
+	inodeHead node;
+
+	dread(fd, &node, INODESIZE, offset, "failed to read entire Inode header\n");
+	lazyApply(offset, node);
+
+	return node;
+}
+
+void chainFree(int fd, uint32_t start_block){
+	if(PDBG) fprintf(stderr, "chain free\n");
+	lazyDrop(INDEX(start_block));
+	ncache.releaseChain(fd, start_block);
+}
+
+/**************************************************************
+packed inodes
+**************************************************************/
+
+/*
+	with the pack feature, files and symlinks small enough share blocks:
+	an inode and its data take one slot of a pack block. pack blocks with
+	free slots are chained from the superblock. a packed inode that grows
+	out of its slot moves to a block of its own and leaves a forward in
+	the slot, which directory entries are pointed past as they are found
+*/
+
+//covers the pack list, the slot maps and the link counts of forwards
+pthread_mutex_t packlock = PTHREAD_MUTEX_INITIALIZER;
+
+static void setPackHead(int fd, uint32_t block_num){
+
+	sext.packHead = block_num;
+	dwrite(fd, &(sext.packHead), BNUMSIZE, EXTDEX+offsetof(superExt, packHead), "failed to update pack list\n");
+}
+
+//puts a pack block at the front of the list of those with room
+static void packLink(int fd, uint32_t block_num, packHead& head){
+
+	head.next = sext.packHead;
+	head.prev = 0;
+	head.listed = 1;
+	if(head.next != 0){
+		dwrite(fd, &block_num, BNUMSIZE, INDEX(head.next)+offsetof(packHead, prev), "failed to link pack block\n");
+	}
+	setPackHead(fd, block_num);
+}
+
+static void packUnlink(int fd, packHead& head){
+
+	if(head.prev != 0){
+		dwrite(fd, &(head.next), BNUMSIZE, INDEX(head.prev)+offsetof(packHead, next), "failed to unlink pack block\n");
+	}
+	else{
+		setPackHead(fd, head.next);
+	}
+	if(head.next != 0){
+		dwrite(fd, &(head.prev), BNUMSIZE, INDEX(head.next)+offsetof(packHead, prev), "failed to unlink pack block\n");
+	}
+	head.next = 0;
+	head.prev = 0;
+	head.listed = 0;
+}
+
+//takes a free slot, starting a new pack block if none has one. 0 if out of space
+uint32_t packAlloc(int fd){
+
+	packHead head = {PACK_NUM, 1, 0, 0, 0};
+	uint32_t block_num;
+	uint32_t slot = 1;
+
+	pthread_mutex_lock(&packlock);
+	if((block_num = sext.packHead) != 0){
+		dread(fd, &head, sizeof(packHead), INDEX(block_num), "failed to read pack block\n");
+	}
+	else if((block_num = ncache.getNewBlock(fd, &head, sizeof(packHead), true, 0)) == 0){
+		pthread_mutex_unlock(&packlock);
+		return 0;
+	}
+	else if(block_num > PACKBLOCK(~0u)){
+
+		//slot numbers only reach so far into the image
+		ncache.release(fd, block_num);
+		pthread_mutex_unlock(&packlock);
+		return 0;
+	}
+	else{
+		packLink(fd, block_num, head);
+	}
+
+	while(head.used & (1<<slot)){
+		slot++;
+	}
+	head.used |= 1<<slot;
+
+	//a full block leaves the list
+	if(head.used == (1<<PACKSLOTS)-1){
+		packUnlink(fd, head);
+	}
+	dwrite(fd, &head, sizeof(packHead), INDEX(block_num), "failed to update pack block\n");
+	pthread_mutex_unlock(&packlock);
+
+	return PACKFLAG | block_num<<PACKSHIFT | slot;
+}
+
+//gives a slot back, a pack block left empty is freed. packlock must be held
+static void packRelease(int fd, uint32_t id){
+
+	uint32_t block_num = PACKBLOCK(id);
+	packHead head;
+
+	lazyDrop(INODEAT(id));
+	dread(fd, &head, sizeof(packHead), INDEX(block_num), "failed to read pack block\n");
+	head.used &= ~(1 << (id & (PACKSLOTS-1)));
+
+	if(head.used == 1){
+		if(head.listed){
+			packUnlink(fd, head);
+		}
+		ncache.release(fd, block_num);
+		return;
+	}
+	if(!head.listed){
+		packLink(fd, block_num, head);
+	}
+	dwrite(fd, &head, sizeof(packHead), INDEX(block_num), "failed to update pack block\n");
+}
+
+void packFree(int fd, uint32_t id){
+
+	pthread_mutex_lock(&packlock);
+	packRelease(fd, id);
+	pthread_mutex_unlock(&packlock);
+}
+
+/*
+	puts a new inode in a slot when the image packs and it fits, returns 0
+	when it has to get a block of its own
+*/
+uint32_t packInode(int fd, inodeHead& inode){
+
+	uint32_t id;
+
+	if(!(sext.features & PACKFEATURE) || S_ISDIR(inode.mode) || inode.size > PACKCAP || (id = packAlloc(fd)) == 0){
+		return 0;
+	}
+	dwrite(fd, &inode, INODESIZE, INODEAT(id), "failed to write packed inode\n");
+	return id;
+}
+
+//the block an unpacked inode moved to, 0 if id is not a forward
+uint32_t forwardOf(int fd, uint32_t id){
+
+	inodeHead inode;
+
+	if(!PACKED(id)){
+		return 0;
+	}
+	inode = readInode(fd, INODEAT(id));
+	return inode.typeCode == FORWARD_NUM ? inode.rdev : 0;
+}
+
+uint32_t resolveInode(int fd, uint32_t id){
+
+	uint32_t target = forwardOf(fd, id);
+
+	return target != 0 ? target : id;
+}
+
+/*
+	one less directory entry names the forward at id. the forward keeps the
+	count in its link field and its slot goes with the last one. packlock
+	must be held
+*/
+void dropForward(int fd, uint32_t id){
+
+	inodeHead inode = readInode(fd, INODEAT(id));
+
+	if(--inode.Nlink == 0){
+		packRelease(fd, id);
+	}
+	else{
+		dwrite(fd, &(inode.Nlink), NLINKSIZE, INODEAT(id)+NLINKDEX, "failed to update forward\n");
+	}
+}
+
+/*
+	moves a packed inode to a block of its own, leaving a forward behind for
+	the entries naming it. returns the new block, 0 if out of space
+*/
+uint32_t unpackInode(int fd, uint32_t id){
+
+	uint8_t slot[SLOTSIZE];
+	inodeHead* inode = (inodeHead*)slot;
+	inodeHead forward;
+	uint32_t bnum;
+
+	dread(fd, slot, SLOTSIZE, INODEAT(id), "failed to read packed inode\n");
+	lazyApply(INODEAT(id), *inode);
+	if((bnum = ncache.getNewBlock(fd, slot, INODESIZE, true, ncache.groupOf(PACKBLOCK(id)))) == 0){
+		return 0;
+	}
+	datawrite(fd, slot+INODESIZE, (unsigned)inode->size, INDEX(bnum)+INODESIZE, "failed to move packed data\n");
+
+	memset(&forward, 0, INODESIZE);
+	forward.typeCode = FORWARD_NUM;
+	forward.Nlink = inode->Nlink;
+	forward.rdev = bnum;
+	dwrite(fd, &forward, INODESIZE, INODEAT(id), "failed to leave forward\n");
+	lazyDrop(INODEAT(id));
+
+	return bnum;
+}
+
+/*
+	the inode a data operation up to end bytes should work on: forwards are
+	followed, and a packed inode that would outgrow its slot is moved out.
+	0 if that found no space
+*/
+uint32_t growInode(int fd, uint32_t id, uint64_t end){
+
+	uint32_t moved = resolveInode(fd, id);
+
+	if(!PACKED(moved) || end <= PACKCAP){
+		return moved;
+	}
+
+	//an operation still reading the slot would find another file in it once the slot is reused
+	pthread_rwlock_unlock(&fslock);
+	pthread_rwlock_wrlock(&fslock);
+	if(PACKED(moved = resolveInode(fd, id))){
+		moved = unpackInode(fd, moved);
+	}
+	pthread_rwlock_unlock(&fslock);
+	pthread_rwlock_rdlock(&fslock);
+
+	return moved;
+}
+
+//sets the size of a packed inode, zeroing what it gains
+void packResize(int fd, uint32_t id, inodeHead& inode, uint64_t size){
+
+	if(size > inode.size){
+		datawrite(fd, EMPTY_BLOCK, (unsigned)(size-inode.size), INODEAT(id)+INODESIZE+inode.size, "failed to zero packed data\n");
+	}
+	inode.size = size;
+	dwrite(fd, &(inode.size), SIZESIZE, INODEAT(id)+SIZEDEX, "failed to update packed size\n");
+}
+
+/**************************************************************
+orphan reclaim
+**************************************************************/
+
+pthread_t reclaimer;
+pthread_cond_t reclaimWake = PTHREAD_COND_INITIALIZER;
+bool reclaimRunning = false;
+bool reclaimStop = false;
+
+/*
+	the list head is all the reclaim thread shares with operations, the
+	chains it frees go back through the group locks. it takes no fslock,
+	so a commit can land between moving the head and freeing the chain,
+	which like a crash there only leaks the orphan
+*/
+pthread_mutex_t orphanlock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	puts an inode that lost its last link on the orphan list kept in the
+	superblock. the orphan is linked through its rdev field, which means
+	nothing once the inode is gone, and is freed later by the reclaim thread
+*/
+void orphanAdd(int fd, uint32_t block_num, inodeHead& inode){
+
+	pthread_mutex_lock(&orphanlock);
+	inode.typeCode = ORPHAN_NUM;
+	inode.rdev = sext.orphanHead;
+	dwrite(fd, &inode, offsetof(inodeHead, flags), INDEX(block_num), "failed to mark inode as orphan\n");
+	ncache.setKind(block_num, ORPHAN_NUM);
+
+	sext.orphanHead = block_num;
+	dwrite(fd, &(sext.orphanHead), BNUMSIZE, EXTDEX+offsetof(superExt, orphanHead), "failed to update orphan list\n");
+
+	pthread_cond_signal(&reclaimWake);
+	pthread_mutex_unlock(&orphanlock);
+}
+
+/*
+	takes the first orphan off the list and frees its chain. the list head
+	moves first, so a crash in between leaks the orphan instead of freeing
+	it twice. returns false once the list is empty
+*/
+bool orphanReclaim(int fd){
+
+	uint32_t block_num;
+	inodeHead inode;
+
+	pthread_mutex_lock(&orphanlock);
+	if((block_num = sext.orphanHead) == 0){
+		pthread_mutex_unlock(&orphanlock);
+		return false;
+	}
+	inode = readInode(fd, INDEX(block_num));
+
+	sext.orphanHead = inode.rdev;
+	dwrite(fd, &(sext.orphanHead), BNUMSIZE, EXTDEX+offsetof(superExt, orphanHead), "failed to update orphan list\n");
+	pthread_mutex_unlock(&orphanlock);
+
+	chainFree(fd, block_num);
+	return true;
+}
+
+void* reclaimLoop(void* unused){
+
+	struct timespec wake;
+
+	pthread_mutex_lock(&orphanlock);
+	while(!reclaimStop){
+		pthread_mutex_unlock(&orphanlock);
+		if(orphanReclaim(fsargs.fd)){
+			pthread_mutex_lock(&orphanlock);
+			continue;
+		}
+		pthread_mutex_lock(&orphanlock);
+
+		//an orphan added since the list was found empty has signaled already
+		if(sext.orphanHead != 0){
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += RECLAIMPERIOD;
+		pthread_cond_timedwait(&reclaimWake, &orphanlock, &wake);
+	}
+	pthread_mutex_unlock(&orphanlock);
+
+	return NULL;
+}
+
+/**************************************************************
+block pool
+**************************************************************/
+
+pthread_t pooler;
+bool poolRunning = false;
+bool poolStop = false;
+
+//the pool thread sleeps on zerolock, the free lists it walks are behind their group locks
+pthread_mutex_t zerolock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	keeps the blocks at the front of the free list zeroed so allocations
+	that need a clean block do not have to write one out themselves
+*/
+void* poolLoop(void* unused){
+
+	struct timespec wake;
+	bool zeroed;
+
+	pthread_mutex_lock(&zerolock);
+	while(!poolStop){
+		pthread_mutex_unlock(&zerolock);
+
+		//one block per turn so a commit is not held up
+		{
+			FSLock lock;
+			zeroed = ncache.zeroAhead(fsargs.fd, ZEROPOOL);
+		}
+
+		pthread_mutex_lock(&zerolock);
+		if(zeroed){
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += POOLPERIOD;
+		pthread_cond_timedwait(&poolWake, &zerolock, &wake);
+	}
+	pthread_mutex_unlock(&zerolock);
+
+	return NULL;
+}
+
+/**************************************************************
+prefetch
+**************************************************************/
+
+pthread_t prefetcher;
+bool prefetchRunning = false;
+bool prefetchStop = false;
+
+//progress of the prefetch in blocks
+uint64_t prefetchDone = 0;
+uint64_t prefetchTotal = 0;
+
+/*
+	warms the cache right after mount by streaming through the image in large
+	sequential reads instead of a small read per block on first use. stops
+	early once the cache could not hold any more
+*/
+void* prefetchLoop(void* unused){
+
+	uint8_t* chunk;
+	uint32_t count;
+
+	if((chunk = (uint8_t*)malloc(INDEX(PREFETCHBLOCKS))) == NULL){
+		perror("failed to allocate prefetch buffer");
+		return NULL;
+	}
+
+	pthread_rwlock_wrlock(&fslock);
+	prefetchDone = 0;
+	prefetchTotal = std::min((uint64_t)ncache.usedBlocks(fsargs.fd), ncache.capacity());
+
+	while(!prefetchStop && prefetchDone < prefetchTotal){
+		count = std::min((uint64_t)PREFETCHBLOCKS, prefetchTotal-prefetchDone);
+
+		//the read happens with the lock taken alone so no operation can change the blocks underneath it
+		if(imgRead(fsargs.fd, chunk, INDEX(count), INDEX((off_t)prefetchDone)) != (ssize_t)INDEX(count)){
+			perror("failed to prefetch image");
+			break;
+		}
+		ncache.fill(prefetchDone, count, chunk);
+		prefetchDone += count;
+
+		//operations waiting on the lock get in between reads
+		pthread_rwlock_unlock(&fslock);
+		pthread_rwlock_wrlock(&fslock);
+	}
+	pthread_rwlock_unlock(&fslock);
+
+	if(PDBG) fprintf(stderr, "prefetched %lu of %lu blocks\n", prefetchDone, prefetchTotal);
+	free(chunk);
+	return NULL;
+}
+
+/**************************************************************
+commit thread
+**************************************************************/
+
+pthread_t committer;
+bool commitRunning = false;
+bool commitStop = false;
+
+//the commit thread sleeps on commitlock
+pthread_mutex_t commitlock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	commits what operations changed every few seconds, or sooner when a lot
+	is waiting. the record is written with fslock taken alone, waiting for
+	the disk happens outside it
+*/
+void* commitLoop(void* unused){
+
+	struct timespec wake;
+
+	pthread_mutex_lock(&commitlock);
+	while(!commitStop){
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += COMMITPERIOD;
+		pthread_cond_timedwait(&commitWake, &commitlock, &wake);
+
+		//a commit with nothing waiting writes nothing
+		pthread_mutex_unlock(&commitlock);
+		{
+			FSExclusive lock;
+			journal.commit(fsargs.fd, false);
+		}
+		journal.finish(fsargs.fd);
+		pthread_mutex_lock(&commitlock);
+	}
+	pthread_mutex_unlock(&commitlock);
+
+	return NULL;
+}
+
+/**************************************************************
+fsync
+**************************************************************/
+
+//batched calls gather on syncLock, a round is numbered when its sync starts
+pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t syncDone = PTHREAD_COND_INITIALIZER;
+uint64_t syncStarted = 0;
+uint64_t syncFinished = 0;
+bool syncLeader = false;
+uint32_t syncWindow = SYNCWINDOW;
+
+//what the last rounds returned by round number, a caller wakes long before its slot comes around again
+int syncResults[SYNCROUNDS];
+
+//what each mode cost, under syncLock
+uint64_t syncCalls = 0;
+uint64_t syncRounds = 0;
+uint64_t syncShared = 0;
+uint64_t syncSkipped = 0;
+uint64_t syncFlushes = 0;
+uint64_t syncWaitNs = 0;
+
+/*
+	makes every finished operation durable. with the journal that is a
+	commit, the record is written with fslock taken alone and the wait
+	happens outside it. file data goes home directly, so a commit with nothing to write
+	still needs the sync. times held back by cfs_lazytime are the caller's
+	to write out first
+*/
+static int syncImage(int fd){
+
+	bool wrote = false;
+
+	if(journal.on){
+		FSExclusive lock;
+		wrote = journal.commit(fd, false);
+	}
+
+	if(journal.on){
+		journal.finish(fd);
+	}
+	if(!wrote && fdatasync(fd) != 0){
+		return -errno;
+	}
+
+	pthread_mutex_lock(&syncLock);
+	syncRounds++;
+	pthread_mutex_unlock(&syncLock);
+	return 0;
+}
+
+/*
+	group commit. the first caller waits out the window for others to join,
+	then syncs once for all of them. callers arriving while a sync is under
+	way are not covered by it and wait for the next round
+*/
+static int groupSync(int fd){
+
+	uint64_t want;
+	uint64_t round = 0;
+	int res;
+
+	pthread_mutex_lock(&syncLock);
+	want = syncStarted+1;
+	while(syncFinished < want){
+		if(syncLeader){
+			pthread_cond_wait(&syncDone, &syncLock);
+			continue;
+		}
+
+		syncLeader = true;
+		pthread_mutex_unlock(&syncLock);
+		usleep(syncWindow);
+		pthread_mutex_lock(&syncLock);
+		round = ++syncStarted;
+		pthread_mutex_unlock(&syncLock);
+
+		res = syncImage(fd);
+
+		pthread_mutex_lock(&syncLock);
+		syncResults[round % SYNCROUNDS] = res;
+		syncFinished = round;
+		syncLeader = false;
+		pthread_cond_broadcast(&syncDone);
+	}
+	if(want != round){
+		syncShared++;
+	}
+	res = syncResults[want % SYNCROUNDS];
+	pthread_mutex_unlock(&syncLock);
+	return res;
+}
+
+static int syncStats(char* buff, size_t size){
+
+	static const char* modes[] = {"strict", "batch", "fast"};
+
+	pthread_mutex_lock(&syncLock);
+	int len = snprintf(buff, size, "sync %s %lu fsyncs %lu syncs %lu shared %lu skipped %lu flushes %lu us waiting\n", modes[fsargs.syncMode], syncCalls, syncRounds, syncShared, syncSkipped, syncFlushes, syncWaitNs/1000);
+	pthread_mutex_unlock(&syncLock);
+	return len;
+}
+
+/**************************************************************
+Classes
+**************************************************************/
+
+
+/**************************************************************
+FileCursor
+**************************************************************/
+class FileCursor{
+	public:
+	uint64_t base;
+	uint64_t offset;
+	uint64_t prev;
+
+	//a hole block stands in for several extents, these track where in it the cursor is
+	bool hole;
+	uint32_t holePos;
+	uint32_t holeLeft;
+
+	void moveToExtent(int fd, uint32_t headSize);
+	bool nextExtent(int fd, bool sparse);
+	void skipHole(uint32_t count){holePos += count; holeLeft -= count;}
+
+	FileCursor(uint32_t block_num, uint32_t headSize){base = INDEX(block_num); offset = base+headSize; prev = 0; hole = false; holePos = 0; holeLeft = 0;}
+	FileCursor(){base = 0; offset = 0; prev = 0; hole = false; holePos = 0; holeLeft = 0;}
+};
+
+void FileCursor::moveToExtent(int fd, uint32_t headSize){
+	prev = base;
+	base = INDEX(ncache.getNext(fd, base>>BLOCKSHIFT));
+	offset = base + headSize;
+
+}
+
+/*
+	advances one extent worth of file data. inside a hole block the cursor stays
+	put until every extent the hole stands in for has been passed. returns true
+	when the cursor moved on to another block
+*/
+bool FileCursor::nextExtent(int fd, bool sparse){
+
+	uint32_t span;
+
+	if(holeLeft > 0){
+		skipHole(1);
+		offset = base + FILEEXTENTHEADSIZE;
+		return false;
+	}
+
+	moveToExtent(fd, FILEEXTENTHEADSIZE);
+
+	hole = sparse && base != 0 && ncache.getKind(fd, base>>BLOCKSHIFT) == HEXTENT_NUM;
+	holePos = 0;
+	holeLeft = 0;
+	if(hole){
+		dread(fd, &span, HOLESPANSIZE, base+FILEEXTENTHEADSIZE, "failed to read hole span\n");
+		holeLeft = span-1;
+	}
+	return true;
+}
+
+/*
+	writes len bytes into an unwritten extent, zero filling the rest of its data
+	area so the block can be converted to a regular file extent in one write
+*/
+void fillExtent(int fd, FileCursor& cursor, uint32_t owner, const char* data, uint32_t len){
+
+	uint8_t block[BLOCKSIZE] = {0};
+
+	*((uint32_t*)block) = FEXTENT_NUM;
+	*((uint32_t*)(block+TYPECODESIZE)) = owner;
+	memcpy(block + (cursor.offset - cursor.base), data, len);
+
+	datawrite(fd, block, BLOCKSIZE-BNUMSIZE, cursor.base, "failed to fill unwritten extent\n");
+	ncache.setKind(cursor.base >> BLOCKSHIFT, FEXTENT_NUM);
+}
+
+/*
+	allocates a block with the given head and links it to the end of the chain,
+	the cursor must have just run off the end of the chain. purge zeros the
+	rest of the block
+*/
+bool appendExtent(int fd, FileCursor& cursor, void* head, uint32_t headsize, bool purge){
+
+	uint32_t bnum;
+	uint64_t last = cursor.prev;
+
+	if((bnum = ncache.getNewBlock(fd, head, headsize, purge, ncache.groupOf(last>>BLOCKSHIFT))) == 0){
+		return false;
+	}
+	ncache.setNext(fd, last>>BLOCKSHIFT, bnum);
+
+	cursor = FileCursor(bnum, FILEEXTENTHEADSIZE);
+	cursor.prev = last;
+	cursor.hole = *((uint32_t*)head) == HEXTENT_NUM;
+	return true;
+}
+
+/*
+	carves the extent under the cursor out of its hole as an unwritten extent.
+	the parts of the hole before and after it stay holes and the cursor is left
+	on the new extent. owner's block count is updated on disk
+*/
+bool splitHole(int fd, FileCursor& cursor, uint32_t owner, inodeHead& inode){
+
+	uint32_t hole = cursor.base >> BLOCKSHIFT;
+	uint32_t tail = ncache.getNext(fd, hole);
+	uint32_t head[3] = {HEXTENT_NUM, owner, cursor.holeLeft};
+	uint32_t inset = cursor.offset - cursor.base;
+	uint32_t bnum;
+
+	//the part of the hole after the cursor gets a hole block of its own
+	if(cursor.holeLeft > 0){
+		if((bnum = ncache.getNewBlock(fd, head, HOLEHEADSIZE, false, ncache.groupOf(hole))) == 0){
+			return false;
+		}
+		ncache.setNext(fd, bnum, tail);
+		tail = bnum;
+		inode.blocks++;
+	}
+
+	head[0] = FUEXTENT_NUM;
+	if(cursor.holePos == 0){
+
+		//the hole block itself becomes the extent
+		dwrite(fd, head, TYPECODESIZE, cursor.base, "failed to convert hole\n");
+		ncache.setKind(hole, FUEXTENT_NUM);
+		ncache.setNext(fd, hole, tail);
+	}
+	else{
+
+		//shrink the hole to the part before the cursor and put the extent after it
+		if((bnum = ncache.getNewBlock(fd, head, FILEEXTENTHEADSIZE, false, ncache.groupOf(hole))) == 0){
+			return false;
+		}
+		dwrite(fd, &(cursor.holePos), HOLESPANSIZE, cursor.base+FILEEXTENTHEADSIZE, "failed to shrink hole\n");
+		ncache.setNext(fd, bnum, tail);
+		ncache.setNext(fd, hole, bnum);
+
+		cursor.prev = cursor.base;
+		cursor.base = INDEX(bnum);
+		inode.blocks++;
+	}
+
+	cursor.offset = cursor.base + inset;
+	cursor.hole = false;
+	cursor.holePos = 0;
+	cursor.holeLeft = 0;
+
+	dwrite(fd, &(inode.blocks), ALLBLOCKSSIZE, INDEX(owner)+ALLBLOCKSDEX, "failed to update block count after splitting hole\n");
+	return true;
+}
+
+/*
+	backs count extents of the hole under the cursor, starting first extents
+	into it, with reserved unwritten blocks. the parts of the hole before and
+	after them stay holes, as in splitHole. the hole block is reused for the
+	first extent when the range starts the hole, and the cursor is left on the
+	last new extent. owner's block count is updated in inode only
+*/
+bool fillHole(int fd, FileCursor& cursor, uint32_t owner, inodeHead& inode, uint32_t first, uint32_t count){
+
+	uint32_t hole = cursor.base >> BLOCKSHIFT;
+	uint32_t span = cursor.holePos + cursor.holeLeft + 1;
+	uint32_t tail = ncache.getNext(fd, hole);
+	uint32_t head[3] = {HEXTENT_NUM, owner, span-first-count};
+	uint32_t kind = FUEXTENT_NUM;
+	uint32_t reuse = first == 0;
+	uint32_t last = hole;
+	uint32_t run;
+
+	//the part of the hole after the range gets a hole block of its own
+	if(first+count < span){
+		if((run = ncache.getNewBlock(fd, head, HOLEHEADSIZE, false, ncache.groupOf(hole))) == 0){
+			return false;
+		}
+		ncache.setNext(fd, run, tail);
+		tail = run;
+		inode.blocks++;
+	}
+
+	if(count > reuse){
+		if((run = ncache.getNewRun(fd, count-reuse, owner, FUEXTENT_NUM)) == 0){
+			return false;
+		}
+		last = run+count-reuse-1;
+		ncache.setNext(fd, last, tail);
+		tail = run;
+		inode.blocks += count-reuse;
+	}
+
+	if(reuse){
+		dwrite(fd, &kind, TYPECODESIZE, INDEX(hole), "failed to convert hole\n");
+		ncache.setKind(hole, FUEXTENT_NUM);
+	}
+	else{
+
+		//shrink the hole to the part before the range
+		dwrite(fd, &first, HOLESPANSIZE, INDEX(hole)+FILEEXTENTHEADSIZE, "failed to shrink hole\n");
+	}
+	ncache.setNext(fd, hole, tail);
+
+	cursor.base = INDEX(last);
+	cursor.offset = cursor.base + FILEEXTENTHEADSIZE;
+	cursor.hole = false;
+	cursor.holePos = 0;
+	cursor.holeLeft = 0;
+	return true;
+}
+
+/*
+	zeros the file bytes [from, to) of the chain starting at block_num.
+	holes and unwritten extents already read as zeros and are skipped
+*/
+void zeroRange(int fd, uint32_t block_num, uint64_t from, uint64_t to, bool sparse){
+
+	FileCursor cursor(block_num, INODESIZE);
+	uint64_t metaSize = BLOCKSIZE - INODESIZE - BNUMSIZE;
+	uint64_t left = to > from ? to - from : 0;
+	uint64_t skip;
+	uint32_t span;
+
+	while(from >= metaSize && cursor.base != 0){
+		cursor.nextExtent(fd, sparse);
+		from -= metaSize;
+		metaSize = BLOCKSIZE - FILEEXTENTHEADSIZE - BNUMSIZE;
+
+		if(cursor.hole){
+			skip = std::min((uint64_t)cursor.holeLeft, from/metaSize);
+			cursor.skipHole(skip);
+			from -= skip*metaSize;
+		}
+	}
+	cursor.offset += from;
+
+	while(left > 0 && cursor.base != 0){
+		span = std::min((uint64_t)(BLOCKSIZE + cursor.base - cursor.offset - BNUMSIZE), left);
+
+		if(!cursor.hole && !(sparse && ncache.getKind(fd, cursor.base>>BLOCKSHIFT) == FUEXTENT_NUM)){
+			datawrite(fd, EMPTY_BLOCK, span, cursor.offset, "failed to zero file range\n");
+		}
+
+		left -= span;
+		cursor.nextExtent(fd, sparse);
+	}
+}
+
+
+/**************************************************************
+DirIter
+**************************************************************/
+
+//an entry as it sits in a buffered directory block
+struct dirView{
+	uint16_t len;
+	uint32_t inode_num;
+	std::string_view name;
+};
+
+/*
+	walks the entries of a directory one whole block at a time. each block is
+	read once and its entries are parsed in place, names point into the buffer
+	and stay valid until the iterator moves to the next block
+*/
+class DirIter{
+	public:
+	int fd;
+	uint32_t block;
+	uint32_t prev;
+	uint32_t pos;
+	uint8_t buf[BLOCKSIZE];
+
+	DirIter(int fd, uint32_t dir_block);
+
+	bool next(dirView& view);
+	bool nextInBlock(dirView& view);
+	bool nextSlot(dirView& view);
+	bool nextBlock();
+	bool find(std::string_view name, dirView& view);
+	void follow(dirView& view);
+	uint32_t room(){return BLOCKSIZE - BNUMSIZE - pos;}
+};
+
+/*
+	whether an entry called name could start at byte q of a directory block,
+	going by the entry length in front of it. entries from the old rename
+	code carry padding behind a terminator
+*/
+static inline bool fitsAt(const uint8_t* buf, uint32_t q, uint32_t from, uint32_t to, std::string_view name){
+
+	uint16_t len;
+
+	if(q < from+LENSIZE+BNUMSIZE || q+name.size() > to){
+		return false;
+	}
+	len = *((uint16_t*)(buf+q-LENSIZE-BNUMSIZE));
+	return len == name.size()+LENSIZE+BNUMSIZE || (len > name.size()+LENSIZE+BNUMSIZE && buf[q+name.size()] == 0);
+}
+
+static bool mayHoldScalar(const uint8_t* buf, uint32_t from, uint32_t start, uint32_t to, std::string_view name){
+
+	for(uint32_t q = std::max(start, from+LENSIZE+BNUMSIZE); q < to; q++){
+		if(buf[q] == (uint8_t)name[0] && (name.size() == 1 || buf[q+1] == (uint8_t)name[1]) && fitsAt(buf, q, from, to, name)){
+			return true;
+		}
+	}
+	return false;
+}
+
+#ifdef DIRSIMD
+static bool mayHoldSSE2(const uint8_t* buf, uint32_t from, uint32_t to, std::string_view name){
+
+	__m128i first = _mm_set1_epi8(name[0]);
+	__m128i second = _mm_set1_epi8(name.size() > 1 ? name[1] : 0);
+	uint32_t q = from + LENSIZE + BNUMSIZE;
+	uint32_t mask;
+
+	for(; q + 17 <= to; q += 16){
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(buf+q)), first));
+		if(mask != 0 && name.size() > 1){
+			mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(buf+q+1)), second));
+		}
+		for(; mask != 0; mask &= mask-1){
+			if(fitsAt(buf, q+__builtin_ctz(mask), from, to, name)){
+				return true;
+			}
+		}
+	}
+	return mayHoldScalar(buf, from, q, to, name);
+}
+
+__attribute__((target("avx2")))
+static bool mayHoldAVX2(const uint8_t* buf, uint32_t from, uint32_t to, std::string_view name){
+
+	__m256i first = _mm256_set1_epi8(name[0]);
+	__m256i second = _mm256_set1_epi8(name.size() > 1 ? name[1] : 0);
+	uint32_t q = from + LENSIZE + BNUMSIZE;
+	uint32_t mask;
+
+	for(; q + 33 <= to; q += 32){
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(buf+q)), first));
+		if(mask != 0 && name.size() > 1){
+			mask &= _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(buf+q+1)), second));
+		}
+		for(; mask != 0; mask &= mask-1){
+			if(fitsAt(buf, q+__builtin_ctz(mask), from, to, name)){
+				return true;
+			}
+		}
+	}
+	return mayHoldScalar(buf, from, q, to, name);
+}
+#endif
+
+/*
+	filters a directory block before its entries are parsed: only a block
+	with a spot matching the first bytes of name and an entry length that fits
+	can hold it. the widest vector unit the cpu has is picked on first use
+*/
+static bool mayHold(const uint8_t* buf, uint32_t from, uint32_t to, std::string_view name){
+
+	if(name.empty()){
+		return true;
+	}
+#ifdef DIRSIMD
+	static bool (*scan)(const uint8_t*, uint32_t, uint32_t, std::string_view) = __builtin_cpu_supports("avx2") ? mayHoldAVX2 : mayHoldSSE2;
+	return scan(buf, from, to, name);
+#else
+	return mayHoldScalar(buf, from, from, to, name);
+#endif
+}
+
+DirIter::DirIter(int fd, uint32_t dir_block){
+
+	this->fd = fd;
+	block = dir_block;
+	prev = 0;
+	pos = INODESIZE;
+	dread(fd, buf, BLOCKSIZE, INDEX(block), "failed to read directory block\n");
+}
+
+/*
+	parses the entry at pos, tombstones included. returns false at the end of
+	the block's entries, either a zero length or too little space left for another entry
+*/
+bool DirIter::nextSlot(dirView& view){
+
+	if(block == 0 || pos > BLOCKSIZE-BNUMSIZE-MINDIRSIZE){
+		return false;
+	}
+
+	view.len = *((uint16_t*)(buf+pos));
+	if(view.len < MINDIRSIZE || pos + view.len > BLOCKSIZE-BNUMSIZE){
+		return false;
+	}
+
+	view.inode_num = *((uint32_t*)(buf+pos+LENSIZE));
+	view.name = std::string_view((char*)buf+pos+LENSIZE+BNUMSIZE, view.len-LENSIZE-BNUMSIZE);
+	pos += view.len;
+
+	//renames used to store names with a terminator and padding behind them
+	view.name = view.name.substr(0, view.name.find('\0'));
+	return true;
+}
+
+//next live entry of the block, tombstones left by removals are stepped over
+bool DirIter::nextInBlock(dirView& view){
+
+	while(nextSlot(view)){
+		if(view.inode_num != 0){
+			return true;
+		}
+	}
+	return false;
+}
+
+//loads the next block of the directory, false once there is none
+bool DirIter::nextBlock(){
+
+	prev = block;
+	if((block = ncache.getNext(fd, block)) != 0){
+		dread(fd, buf, BLOCKSIZE, INDEX(block), "failed to read directory block\n");
+		pos = DIREXTENTHEADSIZE;
+	}
+	return block != 0;
+}
+
+bool DirIter::next(dirView& view){
+
+	while(!nextInBlock(view)){
+		if(!nextBlock()){
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+	points the entry the iterator just passed at the block its inode moved
+	to, if it still names a forward
+*/
+void DirIter::follow(dirView& view){
+
+	uint32_t start = pos - view.len;
+	uint32_t target;
+	uint32_t named;
+
+	if(!PACKED(view.inode_num) || (target = forwardOf(fd, view.inode_num)) == 0){
+		return;
+	}
+
+	//a mounted snapshot only reads through the forward
+	if(!snaps.viewing()){
+
+		//lookups share the directory, only the first to get here moves the entry
+		pthread_mutex_lock(&packlock);
+		dread(fd, &named, BNUMSIZE, INDEX(block)+start+LENSIZE, "failed to read dir entry\n");
+		if(named == view.inode_num){
+			dwrite(fd, &target, BNUMSIZE, INDEX(block)+start+LENSIZE, "failed to follow forward\n");
+			dropForward(fd, view.inode_num);
+		}
+		pthread_mutex_unlock(&packlock);
+		*((uint32_t*)(buf+start+LENSIZE)) = target;
+	}
+	view.inode_num = target;
+}
+
+//leaves the iterator just past the entry called name
+bool DirIter::find(std::string_view name, dirView& view){
+
+	do{
+		//blocks that cannot hold the name are passed over without parsing them
+		if(block != 0 && mayHold(buf, pos, BLOCKSIZE-BNUMSIZE, name)){
+			while(nextInBlock(view)){
+				if(view.name == name){
+					return true;
+				}
+			}
+		}
+	}while(nextBlock());
+	return false;
+}
+
+/**************************************************************
+Directory hints
+**************************************************************/
+
+/*
+	where inserts into a directory can go without scanning it: tombstones,
+	free space behind the last entry of inner blocks, and the end of the
+	entries in the last block. only kept in memory: a directory's table
+	entry is dropped when the directory goes, and every hint is checked on
+	disk before it is used
+*/
+struct dirSlot{
+	uint32_t block;
+	uint16_t pos;
+	uint16_t len;
+	bool end;
+};
+
+struct dirHint{
+	uint32_t dir;
+	uint32_t count;
+	uint32_t tail;
+	uint32_t tailEnd;
+	dirSlot slots[DIRSLOTS];
+};
+
+static dirHint dirHints[DIRHINTS];
+
+/*
+	directories sharing a table entry are changed at once, so the table is
+	only touched under hintlock and never across a disk access
+*/
+static pthread_mutex_t hintlock = PTHREAD_MUTEX_INITIALIZER;
+
+//hintlock must be held
+static dirHint* hintFor(uint32_t dir, bool make){
+
+	dirHint* hint = &dirHints[dir % DIRHINTS];
+
+	if(hint->dir != dir){
+		if(!make){
+			return NULL;
+		}
+		hint->dir = dir;
+		hint->count = 0;
+		hint->tail = 0;
+	}
+	return hint;
+}
+
+/*
+	a full table keeps its biggest slots. a block has one free space at its
+	end, so a new one replaces the old
+*/
+static void hintAddSlot(uint32_t dir, uint32_t block, uint32_t pos, uint16_t len, bool end){
+
+	dirHint* hint;
+	uint32_t small = 0;
+
+	pthread_mutex_lock(&hintlock);
+	hint = hintFor(dir, true);
+	for(uint32_t i = 0; i < hint->count; i++){
+		if(hint->slots[i].block == block && (hint->slots[i].pos == pos || (end && hint->slots[i].end))){
+			hint->slots[i] = {block, (uint16_t)pos, len, end};
+			pthread_mutex_unlock(&hintlock);
+			return;
+		}
+		if(hint->slots[i].len < hint->slots[small].len){
+			small = i;
+		}
+	}
+	if(hint->count < DIRSLOTS){
+		small = hint->count++;
+	}
+	else if(hint->slots[small].len >= len){
+		pthread_mutex_unlock(&hintlock);
+		return;
+	}
+	hint->slots[small] = {block, (uint16_t)pos, len, end};
+	pthread_mutex_unlock(&hintlock);
+}
+
+//takes a slot of at least len bytes out of the table, false if there is none
+static bool hintTakeSlot(uint32_t dir, uint16_t len, dirSlot& slot){
+
+	dirHint* hint;
+	bool found = false;
+
+	pthread_mutex_lock(&hintlock);
+	hint = hintFor(dir, false);
+	for(uint32_t i = 0; hint != NULL && i < hint->count && !found; i++){
+		if(hint->slots[i].len >= len){
+			slot = hint->slots[i];
+			hint->slots[i] = hint->slots[--hint->count];
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&hintlock);
+	return found;
+}
+
+static void hintSetTail(uint32_t dir, uint32_t block, uint32_t end){
+
+	dirHint* hint;
+
+	pthread_mutex_lock(&hintlock);
+	hint = hintFor(dir, true);
+	hint->tail = block;
+	hint->tailEnd = end;
+	pthread_mutex_unlock(&hintlock);
+}
+
+//copies out the remembered tail, false if there is none
+static bool hintGetTail(uint32_t dir, uint32_t& block, uint32_t& end){
+
+	dirHint* hint;
+
+	pthread_mutex_lock(&hintlock);
+	hint = hintFor(dir, false);
+	block = hint != NULL ? hint->tail : 0;
+	end = hint != NULL ? hint->tailEnd : 0;
+	pthread_mutex_unlock(&hintlock);
+	return block != 0;
+}
+
+/*
+	moves the tail on if it is still at from, a table entry taken by another
+	directory meanwhile is left alone. false if the tail was elsewhere
+*/
+static bool hintMoveTail(uint32_t dir, uint32_t from, uint32_t block, uint32_t end){
+
+	dirHint* hint;
+	bool moved = false;
+
+	pthread_mutex_lock(&hintlock);
+	hint = hintFor(dir, false);
+	if(hint != NULL && hint->tail == from){
+		hint->tail = block;
+		hint->tailEnd = end;
+		moved = true;
+	}
+	pthread_mutex_unlock(&hintlock);
+	return moved;
+}
+
+static void hintDropBlock(uint32_t dir, uint32_t block){
+
+	dirHint* hint;
+
+	pthread_mutex_lock(&hintlock);
+	hint = hintFor(dir, false);
+
+	for(uint32_t i = 0; hint != NULL && i < hint->count; ){
+		if(hint->slots[i].block == block){
+			hint->slots[i] = hint->slots[--hint->count];
+		}
+		else{
+			i++;
+		}
+	}
+	if(hint != NULL && hint->tail == block){
+		hint->tail = 0;
+	}
+	pthread_mutex_unlock(&hintlock);
+}
+
+static void hintForget(uint32_t dir){
+
+	dirHint* hint;
+
+	pthread_mutex_lock(&hintlock);
+	hint = hintFor(dir, false);
+	if(hint != NULL){
+		hint->dir = 0;
+		hint->count = 0;
+		hint->tail = 0;
+	}
+	pthread_mutex_unlock(&hintlock);
+}
+
+/**************************************************************
+DirData
+**************************************************************/
+class DirData{
+
+	private:
+	void writeInsert(const dirEntry& entry, uint64_t offset, uint16_t len);
+	bool takeSlot(const dirEntry& entry);
+	bool appendTail(const dirEntry& entry);
+	bool addExtent(const dirEntry& entry, uint32_t last);
+	uint32_t blockEnd();
+	void noteEnd();
+	void compact();
+
+	public:
+	dirEntry entry;
+	DirIter dir;
+	int fd;
+	inodeHead parentDir;
+	uint64_t parent_offset;
+	bool found;
+
+	
+	DirData(int fd, uint32_t block_num, const char* name);
+	DirData(int fd, uint32_t parent_block_num, const dirEntry& entry);
+
+	void removeDirEntry();
+	bool renameEntry(const dirEntry& renamed);
+	void decouple();
+	void updateEntryInode(){entry.inode = readInode(fd, INODEAT(entry.inode_num));}
+	bool insertEntry(const dirEntry& entry);
+
+	bool exists(){return found;}
+	bool entryIsEmpty(){return entry.inode.size == 0;}
+	uint16_t entryMode(){return entry.inode.mode;}
+
+	void remove(){
+		removeDirEntry();
+		hintForget(entry.inode_num);
+		chainFree(fd, entry.inode_num);
+	}
+
+};
+
+/*
+	removes the entry the iterator just passed. extended images turn it into
+	a tombstone with a single small write and leave packing the block for
+	later, legacy ones shift the rest of the block over it
+*/
+void DirData::removeDirEntry(){
+	
+	uint32_t start = dir.pos - entry.len;
+	uint32_t end = BLOCKSIZE - BNUMSIZE;
+	uint32_t zero = 0;
+	uint32_t nextnum;
+
+	//update new directory size
+	parentDir.size -= entry.len;
+	dwrite(fd, &(parentDir.size), SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
+
+	if(!(sext.features & TOMBFEATURE)){
+
+		//shift remainder of directory data to cover over the deleted entry
+		memmove(dir.buf+start, dir.buf+dir.pos, end-dir.pos);
+		memset(dir.buf+end-entry.len, 0, entry.len);
+		dwrite(fd, dir.buf+start, end-start, INDEX(dir.block)+start, "failed to write dir remainder\n");
+		dir.pos = start;
+	}
+	else if(dir.pos > end-MINDIRSIZE || *((uint16_t*)(dir.buf+dir.pos)) == 0){
+
+		//the last entry of a block simply goes, the space behind the end has to stay zero
+		memset(dir.buf+start, 0, entry.len);
+		dwrite(fd, dir.buf+start, entry.len, INDEX(dir.block)+start, "failed to clear dir entry\n");
+		dir.pos = start;
+		compact();
+	}
+	else{
+		*((uint32_t*)(dir.buf+start+LENSIZE)) = 0;
+		dwrite(fd, &zero, BNUMSIZE, INDEX(dir.block)+start+LENSIZE, "failed to write dir tombstone\n");
+		hintAddSlot(parent_offset>>BLOCKSHIFT, dir.block, start, entry.len, false);
+		compact();
+	}
+
+	//check if an extent block has now been emptied and should be freed
+	if(dir.prev != 0 && *((uint16_t*)(dir.buf+DIREXTENTHEADSIZE)) == 0){
+
+		hintDropBlock(parent_offset>>BLOCKSHIFT, dir.block);
+		nextnum = ncache.getNext(fd, dir.block);
+		ncache.release(fd, dir.block);
+		
+		//connect previous block to next block
+		ncache.setNext(fd, dir.prev, nextnum);
+
+		parentDir.blocks -= 1;
+		
+		dwrite(fd, &(parentDir.blocks), ALLBLOCKSSIZE, parent_offset+ALLBLOCKSDEX, "failed to write new dir size\n");
+
+	}
+	else{
+		noteEnd();
+	}
+}
 
-	while(!inserted && cursor.base != 0){
+//offset just past the last entry of the buffered block
+uint32_t DirData::blockEnd(){
 
-		curE = cursor.readDirEntry(fd);
-		if(curE.len == 0){
-			
-			//check if enough space
-			if(BLOCKSIZE + cursor.base - cursor.offset >= entry.len){
-				//update dir size
-				writeInsert(entry);
-				dwrite(fd, &(parentDir.size), SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
-				inserted = true;
-			}
+	uint32_t at = dir.prev == 0 ? INODESIZE : DIREXTENTHEADSIZE;
+	uint16_t len;
+
+	while(at <= BLOCKSIZE-BNUMSIZE-MINDIRSIZE){
+		len = *((uint16_t*)(dir.buf+at));
+		if(len < MINDIRSIZE || at+len > BLOCKSIZE-BNUMSIZE){
+			break;
+		}
+		at += len;
+	}
+	return at;
+}
+
+//records the end of the buffered block's entries after they moved
+void DirData::noteEnd(){
+
+	uint32_t end = blockEnd();
+
+	if(!hintMoveTail(parent_offset>>BLOCKSHIFT, dir.block, dir.block, end) && BLOCKSIZE-BNUMSIZE-end >= MINDIRSIZE){
+		hintAddSlot(parent_offset>>BLOCKSHIFT, dir.block, end, BLOCKSIZE-BNUMSIZE-end, true);
+	}
+}
+
+/*
+	packs the live entries of the buffered block together once enough of it
+	is tombstones, or all of it is
+*/
+void DirData::compact(){
+
+	uint32_t from = dir.prev == 0 ? INODESIZE : DIREXTENTHEADSIZE;
+	uint32_t end = BLOCKSIZE - BNUMSIZE;
+	uint32_t to = from;
+	uint32_t dead = 0;
+	uint32_t at;
+	uint16_t len;
+
+	for(at = from; at <= end-MINDIRSIZE; at += len){
+		len = *((uint16_t*)(dir.buf+at));
+		if(len < MINDIRSIZE || at+len > end){
+			break;
+		}
+		if(*((uint32_t*)(dir.buf+at+LENSIZE)) == 0){
+			dead += len;
 		}
+	}
+	end = at;
+
+	if(dead == 0 || (dead < COMPACTBYTES && dead != end-from)){
+		return;
+	}
 
-		if(!inserted && (cursor.atEnd()||curE.len == 0)){
-			cursor.moveToExtent(fd, DIREXTENTHEADSIZE);
+	for(at = from; at < end; at += len){
+		len = *((uint16_t*)(dir.buf+at));
+		if(*((uint32_t*)(dir.buf+at+LENSIZE)) != 0){
+			memmove(dir.buf+to, dir.buf+at, len);
+			to += len;
 		}
 	}
+	memset(dir.buf+to, 0, end-to);
+	dwrite(fd, dir.buf+from, end-from, INDEX(dir.block)+from, "failed to compact dir block\n");
+	dir.pos = to;
+
+	hintDropBlock(parent_offset>>BLOCKSHIFT, dir.block);
+}
+
+/*
+	renames the entry the iterator just passed within its directory. a name
+	that fits is rewritten in the entry's own slot, otherwise the entry is
+	removed and the new name goes to the end of the same block when there
+	is room there, or wherever the hints say
+*/
+bool DirData::renameEntry(const dirEntry& renamed){
 
-	if(!inserted){
+	uint32_t start = dir.pos - entry.len;
+	uint32_t end;
 
-		//get next extent block
-		if((buffer = ncache.getNewBlock(fd, &buffer, DIREXTENTHEADSIZE, true)) != 0){
-			ncache.setNext(fd, (cursor.prev)>>BLOCKSHIFT, buffer);
+	if(renamed.len >= MAXDIRENTRYSIZE){
+		return false;
+	}
+
+	if(renamed.len <= entry.len){
+		memset(dir.buf+start+LENSIZE+BNUMSIZE, 0, entry.len-LENSIZE-BNUMSIZE);
+		memcpy(dir.buf+start+LENSIZE+BNUMSIZE, renamed.name, renamed.len-LENSIZE-BNUMSIZE);
 
-			//write entry to new block
-			cursor = FileCursor(buffer, DIREXTENTHEADSIZE);
-			writeInsert(entry);
+		//a big enough leftover becomes a tombstone, a small one stays as padding
+		if((sext.features & TOMBFEATURE) && entry.len-renamed.len >= MINDIRSIZE){
+			*((uint16_t*)(dir.buf+start)) = renamed.len;
+			*((uint16_t*)(dir.buf+start+renamed.len)) = entry.len-renamed.len;
+			hintAddSlot(parent_offset>>BLOCKSHIFT, dir.block, start+renamed.len, entry.len-renamed.len, false);
 
-			//update parent dir info
+			parentDir.size -= entry.len-renamed.len;
 			dwrite(fd, &(parentDir.size), SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
-			
-			parentDir.blocks += 1;
-			dwrite(fd, &(parentDir.blocks), ALLBLOCKSSIZE, parent_offset+ALLBLOCKSDEX, "failed to write new block count\n");
-			
-			inserted = true;
 		}
+		dwrite(fd, dir.buf+start, entry.len, INDEX(dir.block)+start, "failed to rewrite dir entry\n");
+		return true;
+	}
+
+	removeDirEntry();
+
+	//the block is gone if the entry was all that was left in it
+	if(dir.prev != 0 && *((uint16_t*)(dir.buf+DIREXTENTHEADSIZE)) == 0){
+		dir = DirIter(fd, parent_offset>>BLOCKSHIFT);
+	}
+	else if(BLOCKSIZE-BNUMSIZE-(end = blockEnd()) >= renamed.len){
+		*((uint16_t*)(dir.buf+end)) = renamed.len;
+		*((uint32_t*)(dir.buf+end+LENSIZE)) = renamed.inode_num;
+		memcpy(dir.buf+end+LENSIZE+BNUMSIZE, renamed.name, renamed.len-LENSIZE-BNUMSIZE);
+		dwrite(fd, dir.buf+end, renamed.len, INDEX(dir.block)+end, "failed to insert dir entry\n");
+		noteEnd();
+
+		parentDir.size += renamed.len;
+		dwrite(fd, &(parentDir.size), SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
+		return true;
+	}
+
+	return insertEntry(renamed);
+}
+
+void DirData::decouple(){
+
+	entry.inode.Nlink--;
+	if(PDBG) fprintf(stderr, "Nlink count is now: %d\n", (int)(entry.inode.Nlink));
+
+	if(entry.inode.Nlink == 0 && PACKED(entry.inode_num)){
+		packFree(fd, entry.inode_num);
+	}
+	else if(entry.inode.Nlink == 0 && (sext.features & ORPHANFEATURE)){
+		orphanAdd(fd, entry.inode_num, entry.inode);
+	}
+	else if(entry.inode.Nlink == 0){
+			chainFree(fd, entry.inode_num);	
+		}
+	else{
+
+		dwrite(fd,&(entry.inode.Nlink), NLINKSIZE, INODEAT(entry.inode_num)+NLINKDEX,"failed to decrement Nlink\n");
+
+	}
+
+}
+
+/*
+	puts entry into a slot the hints know of. a tombstone with room for
+	another entry behind it is split, otherwise the name gets padded
+*/
+bool DirData::takeSlot(const dirEntry& entry){
+
+	uint8_t head[LENSIZE+BNUMSIZE];
+	dirSlot slot;
+
+	while(hintTakeSlot(parent_offset>>BLOCKSHIFT, entry.len, slot)){
+
+		//stale slots are dropped
+		dread(fd, head, (slot.end ? LENSIZE : LENSIZE+BNUMSIZE), INDEX(slot.block)+slot.pos, "failed to read dir slot\n");
+		if(slot.end){
+			if(*((uint16_t*)head) != 0){
+				continue;
+			}
+			if(slot.len - entry.len >= MINDIRSIZE){
+				hintAddSlot(parent_offset>>BLOCKSHIFT, slot.block, slot.pos+entry.len, slot.len-entry.len, true);
+			}
+			slot.len = entry.len;
+		}
+		else if(*((uint16_t*)head) != slot.len || *((uint32_t*)(head+LENSIZE)) != 0){
+			continue;
+		}
+		else if(slot.len - entry.len >= MINDIRSIZE){
+			*((uint16_t*)head) = slot.len - entry.len;
+			dwrite(fd, head, LENSIZE+BNUMSIZE, INDEX(slot.block)+slot.pos+entry.len, "failed to split dir slot\n");
+			hintAddSlot(parent_offset>>BLOCKSHIFT, slot.block, slot.pos+entry.len, slot.len-entry.len, false);
+			slot.len = entry.len;
+		}
+
+		writeInsert(entry, INDEX(slot.block)+slot.pos, slot.len);
+		parentDir.size += slot.len;
+		dwrite(fd, &(parentDir.size), SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
+		return true;
+	}
+	return false;
+}
+
+/*
+	appends entry behind the last one of the directory when the hints know
+	where that is, so creating many names in one directory does not rescan it
+*/
+bool DirData::appendTail(const dirEntry& entry){
+
+	uint32_t tail;
+	uint32_t end;
+	uint16_t len = 0;
+
+	if(!hintGetTail(parent_offset>>BLOCKSHIFT, tail, end)){
+		return false;
+	}
+
+	if(end <= BLOCKSIZE-BNUMSIZE-MINDIRSIZE){
+		dread(fd, &len, LENSIZE, INDEX(tail)+end, "failed to read dir end\n");
+	}
+	if(len != 0 || ncache.getNext(fd, tail) != 0){
+		hintMoveTail(parent_offset>>BLOCKSHIFT, tail, 0, 0);
+		return false;
+	}
+
+	if(BLOCKSIZE-BNUMSIZE-end < entry.len){
+		return addExtent(entry, tail);
+	}
+
+	writeInsert(entry, INDEX(tail)+end, entry.len);
+	hintMoveTail(parent_offset>>BLOCKSHIFT, tail, tail, end+entry.len);
+	parentDir.size += entry.len;
+	dwrite(fd, &(parentDir.size), SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
+	return true;
+}
+
+//starts a new extent block behind last with entry in it
+bool DirData::addExtent(const dirEntry& entry, uint32_t last){
+
+	uint32_t buffer = DEXTENT_NUM;
+
+	//get next extent block
+	if((buffer = ncache.getNewBlock(fd, &buffer, DIREXTENTHEADSIZE, true, ncache.groupOf(parent_offset>>BLOCKSHIFT))) != 0){
+		ncache.setNext(fd, last, buffer);
+
+		//write entry to new block
+		writeInsert(entry, INDEX(buffer)+DIREXTENTHEADSIZE, entry.len);
+		hintSetTail(parent_offset>>BLOCKSHIFT, buffer, DIREXTENTHEADSIZE+entry.len);
+
+		//update parent dir info
+		parentDir.size += entry.len;
+		dwrite(fd, &(parentDir.size), SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
+		
+		parentDir.blocks += 1;
+		dwrite(fd, &(parentDir.blocks), ALLBLOCKSSIZE, parent_offset+ALLBLOCKSDEX, "failed to write new block count\n");
 		
+		return true;
+	}
+
+	return false;
+}
+
+bool DirData::insertEntry(const dirEntry& entry){
+
+	dirView view;
+
+	if(takeSlot(entry) || appendTail(entry)){
+		return true;
+	}
+
+	//the entry goes in the first tombstone big enough, or after the last entry of the first block with room left behind it
+	do{
+		while(dir.nextSlot(view)){
+			if(view.inode_num == 0){
+				hintAddSlot(parent_offset>>BLOCKSHIFT, dir.block, dir.pos-view.len, view.len, false);
+				if(view.len >= entry.len && takeSlot(entry)){
+					return true;
+				}
+			}
+		}
+
+		if(dir.room() >= entry.len){
+			writeInsert(entry, INDEX(dir.block)+dir.pos, entry.len);
+			parentDir.size += entry.len;
+			dwrite(fd, &(parentDir.size), SIZESIZE, parent_offset+SIZEDEX, "failed to write new dir size\n");
+
+			//from the last block on, later inserts can go straight to its end
+			if(ncache.getNext(fd, dir.block) == 0){
+				hintSetTail(parent_offset>>BLOCKSHIFT, dir.block, dir.pos+entry.len);
+			}
+			return true;
+		}
+	}while(dir.nextBlock());
+
+	return addExtent(entry, dir.prev);
+}
+
+//writes entry as a record of len bytes, zero padded behind the name
+void DirData::writeInsert(const dirEntry& entry, uint64_t offset, uint16_t len){
+
+	uint8_t* buffer = (uint8_t*)scratch.get(len);
+
+	//do insertion
+	memset(buffer, 0, len);
+	*((uint16_t*)buffer) = len;
+	*((uint32_t*)(buffer+2)) = entry.inode_num;
+	memcpy(buffer+6, entry.name, entry.len - LENSIZE - BNUMSIZE);
+	
+	if(PDBG) fprintf(stderr, "inserting new entry len: %d inode_num: %d name: %s\n",*((uint16_t*)buffer),*((uint32_t*)(buffer+2)), entry.name);
+	
+	dwrite(fd, buffer, len, offset, "failed to insert dir entry");
+}
+
+DirData::DirData(int fd, uint32_t block_num, const char* name) : dir(fd, block_num){
+	
+	dirView view;
+
+	this->fd = fd;
+	parent_offset = INDEX(block_num);
+	parentDir = readInode(fd, INDEX(block_num));
+	entry.name = NULL;
+	entry.len = 0;
+	
+	if((found = dir.find(name, view))){
+		dir.follow(view);
+		entry.len = view.len;
+		entry.inode_num = view.inode_num;
+		updateEntryInode();
+
+		if(PDBG) fprintf(stderr,"found dir entry in parent dir - len: %d name: %s\n", entry.len, name);
+	}
+}
+
+DirData::DirData(int fd, uint32_t parent_block_num, const dirEntry& entry) : dir(fd, parent_block_num){
+	
+	this->fd = fd;
+	parent_offset = INDEX(parent_block_num);
+	memcpy(&parentDir, dir.buf, INODESIZE);
+
+	this->entry = entry;
+	found = entry.len < MAXDIRENTRYSIZE;
+
+	if(found){
+		if(PDBG) fprintf(stderr, "-------inserting entry into dir----------- %s %d %d\n",entry.name, entry.len, parent_block_num);
+		if(!insertEntry(entry)){
+			found = false;
+			if(PDBG) fprintf(stderr, "could not insert entry\n");
 		
+		}
+	}
+	else{
+		errno = ENAMETOOLONG;
+	}
+}
+
+/**************************************************************/
+/*Read only functions*/
+/**************************************************************/
+
+/*verified*/
+static void set_file_descriptor(void *args, int fd)
+{
+	struct Args *fs = (struct Args*)args;
+	fs->fd = fd;
+}
+
+//a copy of an option's value from the same heap as everything else, strdup goes past the pool
+static char* optString(const char* str){
+
+	size_t len = strlen(str)+1;
+	char* copy = (char*)malloc(len);
+
+	return copy != NULL ? (char*)memcpy(copy, str, len) : NULL;
+}
+
+/*
+	reads the number at the end of an option. false unless it is nothing
+	but digits and falls between 1 and max
+*/
+static bool optNumber(const char* str, unsigned long max, unsigned long* value){
+
+	char* end;
+
+	errno = 0;
+	*value = strtoul(str, &end, 10);
+	return *str >= '0' && *str <= '9' && *end == '\0' && errno == 0 && *value != 0 && *value <= max;
+}
+
+static int mount_option(void *args, const char *opt)
+{
+	struct Args *fs = (struct Args*)args;
+	unsigned long value;
+
+	if(strcmp(opt, "cfs_upgrade") == 0){
+		fs->upgrade = true;
+	}
+	else if(strcmp(opt, "cfs_prefetch") == 0){
+		fs->prefetch = true;
+	}
+	else if(strcmp(opt, "cfs_stats") == 0){
+		fs->stats = true;
+	}
+	else if(strcmp(opt, "cfs_mkfs") == 0){
+		fs->mkfs = true;
+	}
+	else if(strcmp(opt, "cfs_journal") == 0){
+
+		//the journal region is recorded in the extension header
+		fs->upgrade = true;
+		fs->journal = true;
+	}
+	else if(strcmp(opt, "cfs_pack") == 0){
+
+		//packing needs the extension header
+		fs->upgrade = true;
+		fs->pack = true;
+	}
+	else if(strcmp(opt, "cfs_snapshot") == 0){
+
+		//the snapshot table is found through the extension header
+		fs->upgrade = true;
+		fs->snapshot = true;
+	}
+	else if(strncmp(opt, "cfs_snapview=", 13) == 0){
+		fs->snapView = strtoul(opt+13, NULL, 10);
+	}
+	else if(strncmp(opt, "cfs_snapdrop=", 13) == 0){
+		fs->snapDrop = strtoul(opt+13, NULL, 10);
+	}
+	else if(strcmp(opt, "cfs_track") == 0){
+
+		//block epochs are kept in the extension header
+		fs->upgrade = true;
+		fs->track = true;
+	}
+	else if(strncmp(opt, "cfs_send=", 9) == 0){
+		fs->upgrade = true;
+		free(fs->send);
+		fs->send = optString(opt+9);
+	}
+	else if(strncmp(opt, "cfs_sendfrom=", 13) == 0){
+
+		//epoch the last send left the replica at
+		fs->sendFrom = strtoul(opt+13, NULL, 10);
+	}
+	else if(strncmp(opt, "cfs_receive=", 12) == 0){
+		free(fs->receive);
+		fs->receive = optString(opt+12);
+	}
+	else if(strcmp(opt, "cfs_lazytime") == 0){
+		fs->lazytime = true;
+	}
+	else if(strcmp(opt, "cfs_sync=strict") == 0){
+		fs->syncMode = SYNCSTRICT;
+	}
+	else if(strcmp(opt, "cfs_sync=batch") == 0){
+		fs->syncMode = SYNCBATCH;
+	}
+	else if(strcmp(opt, "cfs_sync=fast") == 0){
+		fs->syncMode = SYNCFAST;
+	}
+	else if(strncmp(opt, "cfs_syncwindow=", 15) == 0){
+
+		//microseconds batched fsyncs gather for, under a second
+		if(!optNumber(opt+15, 999999, &value)){
+			return -1;
+		}
+		syncWindow = value;
+	}
+	else if(strncmp(opt, "cfs_grow=", 9) == 0){
+
+		//growth chunk in MiB, at least one block
+		if(!optNumber(opt+9, ((uint64_t)UINT32_MAX<<BLOCKSHIFT)>>20, &value)){
+			return -1;
+		}
+		ncache.growChunk = std::max(value<<20>>BLOCKSHIFT, 1UL);
+	}
+	else if(strncmp(opt, "cfs_cache=", 10) == 0){
+
+		//memory for the block cache in MiB
+		if(!optNumber(opt+10, ((uint64_t)UINT32_MAX*sizeof(cachePage))>>20, &value)){
+			return -1;
+		}
+		ncache.setLimit((value<<20)/sizeof(cachePage));
+	}
+	else{
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	warms the cache from the checkpoint a clean unmount left at the end of the
+	image, then cuts it off. the checkpoint is dropped from the superblock
+	before anything can change, so after a crash the next mount starts cold
+*/
+static void loadCheckpoint(int fd)
+{
+	struct stat sbuf;
+	off_t at = INDEX((off_t)sext.ckptStart);
+
+	//an image that was grown or cut since is stale, as is a bad checksum
+	if(fstat(fd, &sbuf) == 0 && sbuf.st_size == at + sext.ckptBytes){
+		if(!ncache.restore(fd, at, sext.ckptBytes, sext.ckptSum)){
+			fprintf(stderr, "cache checkpoint is damaged, starting cold\n");
+		}
+		if(ftruncate(fd, at) != 0){
+			perror("failed to remove cache checkpoint");
+		}
+	}
+
+	sext.ckptStart = 0;
+	sext.ckptBytes = 0;
+	sext.ckptSum = 0;
+	dwrite(fd, ((uint8_t*)&sext)+offsetof(superExt, ckptStart), CKPTFIELDS, EXTDEX+offsetof(superExt, ckptStart), "failed to clear cache checkpoint\n");
+}
+
+/*
+	formats an empty image with this build's block size: a superblock with
+	the extension header and an empty root directory. everything else comes
+	from growing the image
+*/
+static void makeImage(int fd)
+{
+	uint8_t block[BLOCKSIZE] = {0};
+	superExt* ext = (superExt*)(block+EXTDEX);
+	inodeHead* root = (inodeHead*)block;
+	struct timespec res;
+	struct stat sbuf;
+
+	if(fstat(fd, &sbuf) != 0 || sbuf.st_size != 0){
+		fprintf(stderr, "cfs_mkfs only formats an empty image\n");
+		exit(-1);
+	}
+
+	*((uint32_t*)block) = SUPER_NUM;
+	ext->magic = EXTMAGIC;
+	ext->features = ALLFEATURES;
+	ext->blockShift = BLOCKSHIFT;
+	*((uint32_t*)(block+BLOCKSIZE-2*BNUMSIZE)) = INODE;
+	dwrite(fd, block, BLOCKSIZE, INDEX(SUPERBLOCK), "failed to write superblock\n");
+
+	memset(block, 0, BLOCKSIZE);
+	clock_gettime(CLOCK_REALTIME, &res);
+	root->typeCode = INODE_NUM;
+	root->mode = S_IFDIR|0755;
+	root->Nlink = 2;
+	root->uid = getuid();
+	root->gid = getgid();
+	root->accessTimeS = res.tv_sec;
+	root->accessTimeNS = res.tv_nsec;
+	root->modTimeS = res.tv_sec;
+	root->modTimeNS = res.tv_nsec;
+	root->blocks = 1;
+	dwrite(fd, block, BLOCKSIZE, INDEX(INODE), "failed to write root directory\n");
+}
+
+static void myinit(void)
+{
+	DBG("calling init");
+	FSExclusive lock;
+	uint32_t shift;
+
+	//a replica only takes the stream, it is mounted on its own afterwards
+	if(fsargs.receive != NULL){
+		receiveStream(fsargs.fd, fsargs.receive);
+		return;
+	}
+
+	if(fsargs.mkfs){
+		makeImage(fsargs.fd);
+	}
+
+	dread(fsargs.fd, &sext, sizeof(superExt), EXTDEX, "failed to read superblock extension\n");
+
+	//every offset depends on the block size, an image made with another one can't be read at all
+	shift = sext.magic == EXTMAGIC && (sext.features & GEOMFEATURE) ? sext.blockShift : LEGACYSHIFT;
+	if(shift != BLOCKSHIFT){
+		fprintf(stderr, "image has %u byte blocks, this build uses %u\n", 1u<<shift, BLOCKSIZE);
+		exit(-1);
+	}
+
+	//a snapshot is mounted read only, nothing is replayed, upgraded or started
+	if(fsargs.snapView != 0){
+		if(sext.magic != EXTMAGIC || !(sext.features & SNAPFEATURE)){
+			fprintf(stderr, "image has no snapshots\n");
+			exit(-1);
+		}
+		if((sext.features & JOURNALFEATURE) && journal.pending(fsargs.fd, sext.journalStart)){
+			fprintf(stderr, "journal needs replay, mount the image once first\n");
+			exit(-1);
+		}
+		if(!snaps.load(fsargs.fd) || !snaps.mount(fsargs.snapView)){
+			fprintf(stderr, "no snapshot %u\n", fsargs.snapView);
+			exit(-1);
+		}
+		dread(fsargs.fd, &sext, sizeof(superExt), EXTDEX, "failed to read snapshot superblock extension\n");
+		return;
+	}
+
+	if(sext.magic != EXTMAGIC){
+		memset(&sext, 0, sizeof(superExt));
+
+		//the extension header replaces part of the filler, legacy tools will no longer accept the image
+		if(fsargs.upgrade){
+			sext.magic = EXTMAGIC;
+			sext.features = ALLFEATURES;
+			sext.blockShift = BLOCKSHIFT;
+			dwrite(fsargs.fd, &sext, sizeof(superExt), EXTDEX, "failed to write superblock extension\n");
+		}
+	}
+	else if((sext.features & ALLFEATURES) != ALLFEATURES){
+
+		//images extended by an older version still have filler where the newer fields go
+		if(!(sext.features & AGFEATURE)){
+			memset(sext.agHead, 0, sizeof(sext.agHead));
+		}
+		if(!(sext.features & CKPTFEATURE)){
+			sext.ckptStart = 0;
+			sext.ckptBytes = 0;
+			sext.ckptSum = 0;
+		}
+		if(!(sext.features & GEOMFEATURE)){
+			sext.blockShift = BLOCKSHIFT;
+		}
+		sext.features |= ALLFEATURES;
+		dwrite(fsargs.fd, &sext, sizeof(superExt), EXTDEX, "failed to write superblock extension\n");
+	}
+
+	if(fsargs.pack && sext.magic == EXTMAGIC && !(sext.features & PACKFEATURE)){
+		sext.packHead = 0;
+		sext.features |= PACKFEATURE;
+		dwrite(fsargs.fd, &sext, sizeof(superExt), EXTDEX, "failed to write superblock extension\n");
+	}
+
+	//a crash leaves committed changes in the journal, they go home before anything is read
+	if(fsargs.journal && sext.magic == EXTMAGIC && !(sext.features & JOURNALFEATURE) && !journalCreate(fsargs.fd)){
+		fprintf(stderr, "no room for a journal, mounting without one\n");
+	}
+	if((sext.features & JOURNALFEATURE) && !journal.open(fsargs.fd, sext.journalStart)){
+		fprintf(stderr, "failed to set up the journal\n");
+		exit(-1);
+	}
+	if(journal.on){
+		dread(fsargs.fd, &sext, sizeof(superExt), EXTDEX, "failed to read superblock extension\n");
 	}
 
-	return inserted;
-}
-
-void DirData::writeInsert(dirEntry entry){
+	if(sext.ckptBytes != 0){
+		loadCheckpoint(fsargs.fd);
+	}
 
-	uint8_t* buffer = (uint8_t*)calloc(sizeof(uint8_t), entry.len);
-	//do insertion
-	*((uint16_t*)buffer) = entry.len;
-	*((uint32_t*)(buffer+2)) = entry.inode_num;
-	memcpy(buffer+6, entry.name, entry.len - LENSIZE - BNUMSIZE);
-	
-	if(PDBG) fprintf(stderr, "inserting new entry len: %d inode_num: %d name: %s\n",*((uint16_t*)buffer),*((uint32_t*)(buffer+2)), buffer+6);
-	
-	dwrite(fd, buffer, entry.len, cursor.offset, "failed to insert dir entry");
-	free(buffer);
+	//blocks snapshots share are copied from the first write on
+	if(!snaps.load(fsargs.fd)){
+		fprintf(stderr, "snapshot table is damaged\n");
+		exit(-1);
+	}
+	if(fsargs.snapDrop != 0 && !snaps.drop(fsargs.fd, fsargs.snapDrop)){
+		fprintf(stderr, "no snapshot %u to drop\n", fsargs.snapDrop);
+	}
+	if(fsargs.snapshot && sext.magic == EXTMAGIC){
+		snaps.take(fsargs.fd);
+	}
 
-	if(strcmp(entry.name, "orc.vim") == 0){
+	//every block is behind the first epoch, the first send has to carry all of them
+	if((fsargs.track || fsargs.send != NULL) && sext.magic == EXTMAGIC && !(sext.features & SENDFEATURE)){
+		sext.epochHead = 0;
+		sext.epoch = 1;
+		sext.features |= SENDFEATURE;
+		dwrite(fsargs.fd, &sext, sizeof(superExt), EXTDEX, "failed to write superblock extension\n");
+	}
+	if(!epochs.load(fsargs.fd)){
+		fprintf(stderr, "epoch table is damaged\n");
 		exit(-1);
 	}
-}
+	if(fsargs.send != NULL){
+		sendStream(fsargs.fd, fsargs.send, fsargs.sendFrom);
+	}
 
-DirData::DirData(int fd, uint32_t block_num, const char* name){
-	
-	this->fd = fd;
-	parent_offset = INDEX(block_num);
-	parentDir = readInode(fd, INDEX(block_num));
-	cursor = FileCursor(block_num, INODESIZE);
-	entry.name = NULL;
-	entry.len = 0;
-	
-	while(this->nextEntry() && !(found = this->check(name)));
+	//orphans left behind by a crash are picked up where reclaim stopped
+	if(sext.features & ORPHANFEATURE){
+		reclaimStop = false;
+		reclaimRunning = pthread_create(&reclaimer, NULL, reclaimLoop, NULL) == 0;
+	}
 
+	poolStop = false;
+	poolRunning = pthread_create(&pooler, NULL, poolLoop, NULL) == 0;
 
-}
+	if(journal.on){
+		commitStop = false;
+		commitRunning = pthread_create(&committer, NULL, commitLoop, NULL) == 0;
+	}
 
-DirData::DirData(int fd, uint32_t block_num){
-	
-	cursor = FileCursor(block_num, INODESIZE);
-	this->fd = fd;
-	parent_offset = INDEX(block_num);
-	parentDir = readInode(fd, INDEX(block_num));
-	entry.name = NULL;
-	entry.len = 0;
-	found = false;
+	if(fsargs.lazytime){
+		timerStop = false;
+		timerRunning = pthread_create(&timer, NULL, timeLoop, NULL) == 0;
+	}
 
+	if(fsargs.prefetch){
+		prefetchStop = false;
+		prefetchRunning = pthread_create(&prefetcher, NULL, prefetchLoop, NULL) == 0;
+	}
 }
 
-DirData::DirData(int fd, uint32_t parent_block_num, dirEntry entry){
-	
-	cursor = FileCursor(parent_block_num, INODESIZE);
-	this->fd = fd;
-	parent_offset = cursor.base;
-	parentDir = readInode(fd, parent_offset);
+static int mystats(void *args, char *buff, size_t size)
+{
+	FSLock lock;
 
-	//parentDir = readInode(fd, INDEX(block_num));
-	this->entry = entry;
-	found = entry.len < MAXDIRENTRYSIZE;
+	int len = snprintf(buff, size, "prefetch %lu/%lu blocks\n", prefetchDone, prefetchTotal);
 
-	if(found){
-		if(PDBG) fprintf(stderr, "-------inserting entry into dir----------- %s %d %d\n",entry.name, entry.len, parent_block_num);
-		if(!insertEntry(entry)){
-			found = false;
-			if(PDBG) fprintf(stderr, "could not insert entry\n");
-		
-		}
+	if(len >= 0 && (size_t)len < size){
+		len += allocStats(buff+len, size-len);
 	}
-	else{
-		errno = ENAMETOOLONG;
+	if(journal.on && len >= 0 && (size_t)len < size){
+		len += journalStats(buff+len, size-len);
 	}
-	entry.name = NULL;
+	if(len >= 0 && (size_t)len < size){
+		len += syncStats(buff+len, size-len);
+	}
+	if(fsargs.lazytime && len >= 0 && (size_t)len < size){
+		len += lazyStats(buff+len, size-len);
+	}
+	if(snaps.count() != 0 && len >= 0 && (size_t)len < size){
+		len += snaps.stats(buff+len, size-len);
+	}
+	if(epochs.on && len >= 0 && (size_t)len < size){
+		len += epochs.stats(buff+len, size-len);
+	}
+	return len;
 }
 
-//FIXME
-DirData::~DirData(){
-	if(entry.name != NULL){
-		//free(entry.name);
+static void mydestroy(void)
+{
+	DBG("calling destroy");
+	char buff[BLOCKSIZE];
+	bool replica = fsargs.receive != NULL;
+	uint64_t sum;
+
+	//the stream paths were only needed at mount
+	free(fsargs.send);
+	free(fsargs.receive);
+	fsargs.send = NULL;
+	fsargs.receive = NULL;
+
+	stopWorker(prefetcher, prefetchRunning, prefetchStop, NULL, NULL);
+	stopWorker(reclaimer, reclaimRunning, reclaimStop, &orphanlock, &reclaimWake);
+	stopWorker(pooler, poolRunning, poolStop, &zerolock, &poolWake);
+	stopWorker(committer, commitRunning, commitStop, &commitlock, &commitWake);
+	stopWorker(timer, timerRunning, timerStop, &lazylock, &timerWake);
+
+	if(fsargs.stats){
+		mystats(&fsargs, buff, sizeof(buff));
+		fputs(buff, stderr);
 	}
-}
 
-/**************************************************************/
-/*Read only functions*/
-/**************************************************************/
+	//a snapshot was only read, a replica only written by its stream
+	if(fsargs.snapView != 0 || replica){
+		return;
+	}
 
-/*verified*/
-static void set_file_descriptor(void *args, int fd)
-{
-	struct Args *fs = (struct Args*)args;
-	fs->fd = fd;
+	//leave a clean image behind
+	FSExclusive lock;
+	while(orphanReclaim(fsargs.fd));
+	lazyFlush(fsargs.fd);
+
+	//everything goes home, the journal is empty for the next mount
+	if(journal.on){
+		journal.commit(fsargs.fd, true);
+		journal.finish(fsargs.fd);
+		journal.close();
+	}
+	ncache.trimTail(fsargs.fd);
+
+	//the cache goes after the last used block for the next mount to pick up
+	if(sext.magic == EXTMAGIC){
+		sext.ckptStart = ncache.usedBlocks(fsargs.fd);
+		if((sext.ckptBytes = ncache.checkpoint(fsargs.fd, INDEX((off_t)sext.ckptStart), &sum)) != 0){
+			sext.ckptSum = sum;
+			dwrite(fsargs.fd, ((uint8_t*)&sext)+offsetof(superExt, ckptStart), CKPTFIELDS, EXTDEX+offsetof(superExt, ckptStart), "failed to record cache checkpoint\n");
+		}
+	}
 }
 
 /*verified*/
@@ -665,12 +5154,14 @@ static int mygetattr(void *args, uint32_t block_num, struct stat *stbuf){
 	DBG("calling mygetattr");
 	
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 
 	//check if valid blocknum?
-	inodeHead curHead = readInode(fs->fd, INDEX(block_num));
+	uint32_t inum = resolveInode(fs->fd, block_num);
+	inodeHead curHead = readInode(fs->fd, INODEAT(inum));
 
 	stbuf->st_dev = 0;			//idk
-	stbuf->st_ino = block_num; 	//maybe?
+	stbuf->st_ino = inum; 	//maybe?
 	stbuf->st_mode = curHead.mode;
 	stbuf->st_nlink = curHead.Nlink;
 	stbuf->st_uid = curHead.uid;
@@ -678,7 +5169,7 @@ static int mygetattr(void *args, uint32_t block_num, struct stat *stbuf){
 	stbuf->st_rdev = curHead.rdev;
 	stbuf->st_size = curHead.size;
 	stbuf->st_blksize = BLOCKSIZE;
-	stbuf->st_blocks = curHead.blocks*8;
+	stbuf->st_blocks = PACKED(inum) ? SLOTSIZE/512 : curHead.blocks*(BLOCKSIZE/512);
 
 	//need to update??
 	stbuf->st_atim.tv_sec = curHead.accessTimeS;
@@ -699,50 +5190,87 @@ static int myreaddir(void *args, uint32_t block_num, void *buf, CPE453_readdir_c
 	DBG("calling myreaddir");
 
 	struct Args *fs = (struct Args*)args;
-	DirData data(fs->fd, block_num);
+	FSLock lock;
+	DirIter dir(fs->fd, block_num);
+	dirView view;
+	char name[BLOCKSIZE];
 	
-	while(data.nextEntry()){
-		cb(buf, data.entry.name, data.entry.inode_num);
+	while(dir.next(view)){
+		memcpy(name, view.name.data(), view.name.size());
+		name[view.name.size()] = '\0';
+		cb(buf, name, view.inode_num);
 	}
     return 0;
 }
 
+static uint32_t mylookup(void *args, uint32_t block_num, const char *name){
+
+	DBG("calling mylookup");
+
+	struct Args *fs = (struct Args*)args;
+	FSLock lock;
+	DirIter dir(fs->fd, block_num);
+	dirView view;
+
+	if(!dir.find(name, view)){
+		return 0;
+	}
+	dir.follow(view);
+	return view.inode_num;
+}
+
 /*verified*/
 static int myopen(void *args, uint32_t block_num)
 {
 	DBG("calling myopen");
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 
-	inodeHead inode = readInode(fs->fd, INDEX(block_num));
+	inodeHead inode = readInode(fs->fd, INODEAT(resolveInode(fs->fd, block_num)));
 
 	return S_ISREG(inode.mode)/*&&(check permissions)*/ ? 0 : -1;
 
 }
 
 /*verified*/
-static int myread(void *args, uint32_t block_num, char *buf, size_t size, off_t offset)
+//what myread does, fslock must be held
+static int readFile(void *args, uint32_t id, char *buf, size_t size, off_t offset)
 {
 	DBG("calling myread");
 	//fprintf(stderr, "reading from block %d, size %d, offset %d\n",(int)block_num, (int)size, (int)offset);
 	struct Args *fs = (struct Args*)args;
+	uint32_t block_num = resolveInode(fs->fd, id);
 	FileCursor cursor(block_num, INODESIZE);
 	uint32_t index = 0;
+	uint64_t skip;
 
-	inodeHead inode = readInode(fs->fd, INDEX(block_num));
+	inodeHead inode = readInode(fs->fd, INODEAT(block_num));
+	bool sparse = inode.flags & SPARSEFLAGS;
 
-	int32_t delta = std::min((int)size, (int)(inode.size-offset));
+	int32_t delta = (uint64_t)offset < inode.size ? std::min((uint64_t)size, inode.size-offset) : 0;
 	uint32_t metaSize = BLOCKSIZE - INODESIZE - BNUMSIZE;
 
-	if(delta < 0){
+	if(delta <= 0){
 		//TODO error
 		return 0;
 	}
 
-	while(offset >= metaSize){
-		cursor.moveToExtent(fs->fd,FILEEXTENTHEADSIZE);
+	if(PACKED(block_num)){
+		dread(fs->fd, buf, delta, INODEAT(block_num)+INODESIZE+offset, "failed to read packed data\n");
+		return delta;
+	}
+
+	while((uint64_t)offset >= metaSize){
+		cursor.nextExtent(fs->fd, sparse);
 		//cur = moveToExtent(fs->fd, &base, FILEEXTENTHEADSIZE);
 		offset -= metaSize;
 		metaSize = BLOCKSIZE - FILEEXTENTHEADSIZE - BNUMSIZE;
+
+		if(cursor.hole){
+			skip = std::min((uint64_t)cursor.holeLeft, (uint64_t)offset/metaSize);
+			cursor.skipHole(skip);
+			offset -= skip*metaSize;
+		}
 	}
 	
 	cursor.offset += offset;
@@ -751,26 +5279,40 @@ static int myread(void *args, uint32_t block_num, char *buf, size_t size, off_t
 
 		metaSize = std::min((int)(BLOCKSIZE + cursor.base - cursor.offset - BNUMSIZE), (int)delta);
 
-		dread(fs->fd, buf+index, metaSize, cursor.offset, "failed to read from file into buffer\n");
+		//holes and unwritten extents read back as zeros without touching the image
+		if(cursor.hole || (sparse && ncache.getKind(fs->fd, cursor.base>>BLOCKSHIFT) == FUEXTENT_NUM)){
+			memset(buf+index, 0, metaSize);
+		}
+		else{
+			dread(fs->fd, buf+index, metaSize, cursor.offset, "failed to read from file into buffer\n");
+		}
 
 		index += metaSize;
 		delta -= metaSize;
 		
 
-		if(delta>0) cursor.moveToExtent(fs->fd, FILEEXTENTHEADSIZE);
+		if(delta>0) cursor.nextExtent(fs->fd, sparse);
 	}
 
     return index;
 }
 
+static int myread(void *args, uint32_t id, char *buf, size_t size, off_t offset)
+{
+	FSLock lock;
+
+	return readFile(args, id, buf, size, offset);
+}
+
 /*verified*/
 static int myreadlink(void *args, uint32_t block_num, char *buf, size_t size)
 {
 	DBG("calling myreadlink");
 	struct Args *fs = (struct Args*)args;
-	uint32_t base = INDEX(block_num);
+	FSLock lock;
+	uint64_t base = INODEAT(resolveInode(fs->fd, block_num));
 	//assuming file is properly openend
-	inodeHead inode = readInode(fs->fd, INDEX(block_num));
+	inodeHead inode = readInode(fs->fd, base);
 
 	int32_t delta = std::min((int)size-1, (int)(inode.size));
 
@@ -790,6 +5332,7 @@ static uint32_t root_node(void *args)
 {
 	DBG("calling root_node");
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 
 	uint32_t root_block;
 
@@ -805,25 +5348,34 @@ static uint32_t root_node(void *args)
 /**************************************************************/
 int mychmod(void *args, uint32_t block_num, mode_t new_mode){
 	DBG("calling chmod");
+	ROCHECK
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 	struct timespec res;
-	inodeHead inode = readInode(fs->fd, INDEX(block_num));
+	inodeHead inode;
 
+	block_num = resolveInode(fs->fd, block_num);
+	inode = readInode(fs->fd, INODEAT(block_num));
 	inode.mode = new_mode;
 
 	clock_gettime(CLOCK_REALTIME,&res);
 	inode.statusTimeS = res.tv_sec;
 	inode.statusTimeNS = res.tv_nsec;
 
-	dwrite(fs->fd, &inode, INODESIZE, INDEX(block_num), "failed to write new mode\n");
+	//readInode already put waiting times in inode, one write from the mode to the times takes them all
+	lazyDrop(INODEAT(block_num));
+	headWrite(fs->fd, INODEAT(block_num), inode, MODEDEX, STIMENSDEX+TIMESIZE, "failed to write new mode\n");
 	return 0;
 }
 
 int mychown(void* args, uint32_t block_num, uid_t new_uid, gid_t new_gid){
 	
 	DBG("calling chown");
+	ROCHECK
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 
+	block_num = resolveInode(fs->fd, block_num);
 	return -(LAZYWRITE(new_uid, UIDDEX)||LAZYWRITE(new_gid, GIDDEX));
 
 }
@@ -831,18 +5383,38 @@ int mychown(void* args, uint32_t block_num, uid_t new_uid, gid_t new_gid){
 int myutimens(void* args, uint32_t block_num, const struct timespec tv[2]){
 	
 	DBG("calling utimes");
+	ROCHECK
 
 	struct Args *fs = (struct Args*)args;
-	dwrite(fs->fd, &(tv[0].tv_sec),BNUMSIZE, INDEX(block_num)+ATIMESDEX, "failed to update access time secs");
-	dwrite(fs->fd, &(tv[0].tv_nsec),BNUMSIZE, INDEX(block_num)+ATIMENSDEX, "failed to update access time nsecs");
-	dwrite(fs->fd, &(tv[1].tv_sec),BNUMSIZE, INDEX(block_num)+MTIMESDEX, "failed to update mod time secs");
-	dwrite(fs->fd, &(tv[1].tv_nsec),BNUMSIZE, INDEX(block_num)+MTIMENSDEX, "failed to update mod time nsecs");
+	FSLock lock;
+	struct timespec res;
+	uint32_t times[TIMESBYTES/TIMESIZE];
+	inodeHead inode;
+
+	block_num = resolveInode(fs->fd, block_num);
+	inode = readInode(fs->fd, INODEAT(block_num));
+	memcpy(times, ((uint8_t*)&inode)+ATIMESDEX, TIMESBYTES);
+	clock_gettime(CLOCK_REALTIME,&res);
+
+	//UTIME_OMIT leaves a time as it is, UTIME_NOW takes the current one
+	for(int i = 0; i < 2; i++){
+		if(tv[i].tv_nsec != UTIME_OMIT){
+			times[2*i] = tv[i].tv_nsec == UTIME_NOW ? res.tv_sec : tv[i].tv_sec;
+			times[2*i+1] = tv[i].tv_nsec == UTIME_NOW ? res.tv_nsec : tv[i].tv_nsec;
+		}
+	}
+	times[4] = res.tv_sec;
+	times[5] = res.tv_nsec;
+
+	setTimes(fs->fd, INODEAT(block_num), times);
 	return 0;
 }
 
 int myrmdir(void* args, uint32_t block_num, const char *name){
 	DBG("calling rmdir");
+	ROCHECK
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 	
 	DirData data(fs->fd, block_num, name);
 	int ret = -1;
@@ -875,7 +5447,9 @@ int myrmdir(void* args, uint32_t block_num, const char *name){
 int myunlink(void* args, uint32_t block_num, const char *name){
 	
 	DBG("calling unlink");
+	ROCHECK
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 	DirData data(fs->fd, block_num, name);
 	int ret = -1;
 
@@ -902,8 +5476,10 @@ int myunlink(void* args, uint32_t block_num, const char *name){
 int mymknod(void* args, uint32_t parent_block, const char *name, mode_t new_mode, dev_t new_dev){
 	
 	DBG("calling mknod");
+	ROCHECK
 
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 	inodeHead inode;
 	dirEntry entry;
 	fuse_context* cntxt = fuse_get_context();
@@ -915,7 +5491,8 @@ int mymknod(void* args, uint32_t parent_block, const char *name, mode_t new_mode
 	
 	//dwrite(fs->fd, &inode, INODESIZE, 0, "failed to write inode to new node\n");
 
-	if((bnum = ncache.getNewBlock(fs->fd, (void*)(&inode), INODESIZE, false))!= 0){
+	//files go in a shared slot, or in the group of their directory
+	if((bnum = packInode(fs->fd, inode)) != 0 || (bnum = ncache.getNewBlock(fs->fd, (void*)(&inode), INODESIZE, false, ncache.groupOf(parent_block)))!= 0){
 		
 		FILLENTRY;
 		DirData dir(fs->fd, parent_block, entry);
@@ -929,8 +5506,10 @@ int mymknod(void* args, uint32_t parent_block, const char *name, mode_t new_mode
 int mysymlink(void* args, uint32_t parent_block, const char *name, const char *link_dest){
 	
 	DBG("calling symlink");
+	ROCHECK
 
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 	inodeHead inode;
 	dirEntry entry;
 	fuse_context* cntxt = fuse_get_context();
@@ -940,14 +5519,14 @@ int mysymlink(void* args, uint32_t parent_block, const char *name, const char *l
 
 	FILLINODE(S_IFLNK, strlen(link_dest));
 	//dwrite(fs->fd, &inode, INODESIZE, INDEX(bnum), "failed to write inode to new node\n");
-	if((bnum = ncache.getNewBlock(fs->fd, (void*)(&inode), INODESIZE, false)) != 0){
+	if((bnum = packInode(fs->fd, inode)) != 0 || (bnum = ncache.getNewBlock(fs->fd, (void*)(&inode), INODESIZE, false, ncache.groupOf(parent_block))) != 0){
 
 		
 		FILLENTRY;
 
 		DirData dir(fs->fd, parent_block, entry);
 		if(dir.found){
-			dwrite(fs->fd, link_dest, (unsigned)strlen(link_dest), INDEX(bnum)+INODESIZE, "failed to write symlink data");
+			dwrite(fs->fd, link_dest, (unsigned)strlen(link_dest), INODEAT(bnum)+INODESIZE, "failed to write symlink data");
 			ret = 0;
 		}
 	}
@@ -959,8 +5538,10 @@ int mysymlink(void* args, uint32_t parent_block, const char *name, const char *l
 int mymkdir(void* args, uint32_t parent_block, const char *name, mode_t new_mode){
 	
 	DBG("calling mkdir");
+	ROCHECK
 
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 	inodeHead inode;
 	dirEntry entry;
 	fuse_context* cntxt = fuse_get_context();
@@ -973,7 +5554,8 @@ int mymkdir(void* args, uint32_t parent_block, const char *name, mode_t new_mode
 	//directory points to itself
 	inode.Nlink++;
 	
-	if((bnum = ncache.getNewBlock(fs->fd, (void*)(&inode), INODESIZE, true)) != 0){
+	//directories are spread over the groups to keep their files apart
+	if((bnum = ncache.getNewBlock(fs->fd, (void*)(&inode), INODESIZE, true, ncache.spreadGroup(fs->fd, parent_block))) != 0){
 		FILLENTRY;
 		DirData dir(fs->fd, parent_block, entry);
 		if(dir.found){
@@ -1001,23 +5583,24 @@ int mymkdir(void* args, uint32_t parent_block, const char *name, mode_t new_mode
 int mylink(void* args, uint32_t parent_block, const char *name, uint32_t dest_block){
 	
 	DBG("calling link");
+	ROCHECK
 
 	struct Args *fs = (struct Args*)args;
+	FSLock lock;
 	dirEntry entry;
 	inodeHead inode;
 	uint32_t ret = -1;
 	
-	entry.inode_num = dest_block;
-	entry.name = (char*)calloc(sizeof(char), strlen(name)+1);
-	memcpy(entry.name, name, strlen(name));
+	entry.inode_num = dest_block = resolveInode(fs->fd, dest_block);
+	entry.name = scratch.copy(name);
 	entry.len = strlen(name)+LENSIZE+BNUMSIZE;
 
 	DirData dir(fs->fd, parent_block, entry);
 	
 	if(dir.found){
-		inode = readInode(fs->fd, INDEX(dest_block));
+		inode = readInode(fs->fd, INODEAT(dest_block));
 		inode.Nlink += 1;
-		dwrite(fs->fd, &(inode.Nlink), NLINKSIZE, INDEX(dest_block)+NLINKDEX, "failed to update nlink after linking\n");
+		dwrite(fs->fd, &(inode.Nlink), NLINKSIZE, INODEAT(dest_block)+NLINKDEX, "failed to update nlink after linking\n");
 		ret = 0;
 	}
 	else{
@@ -1030,8 +5613,10 @@ int mylink(void* args, uint32_t parent_block, const char *name, uint32_t dest_bl
 int myrename(void* args, uint32_t old_parent, const char *old_name, uint32_t new_parent, const char *new_name){
 	
 	DBG("calling rename");
+	ROCHECK
 	struct Args *fs = (struct Args*)args;
-	dirEntry oldentry;
+	FSLock lock;
+	dirEntry renamed;
 	DirData data(fs->fd, old_parent, old_name);
 
 	int ret = -1;
@@ -1041,17 +5626,27 @@ int myrename(void* args, uint32_t old_parent, const char *old_name, uint32_t new
 	} 
 	else{
 		//TODO check perms? 
-		oldentry.inode = data.entry.inode;
-		oldentry.inode_num = data.entry.inode_num;
-		oldentry.name = (char*)malloc(strlen(new_name)+1);
-		memcpy(oldentry.name, new_name, strlen(new_name)+1);
-		oldentry.len = strlen(new_name)+1 + BNUMSIZE + SIZESIZE;
+		renamed.inode = data.entry.inode;
+		renamed.inode_num = data.entry.inode_num;
+		renamed.name = (char*)new_name;
+		renamed.len = strlen(new_name) + LENSIZE + BNUMSIZE;
+
+		//within one directory the entry is changed where the lookup left it
+		if(old_parent == new_parent){
+			if(data.renameEntry(renamed)){
+				ret = 0;
+			}
+			else{
+				errno = ENOMEM;
+			}
+			return ret;
+		}
 
 		data.removeDirEntry();
 
-		data = DirData(fs->fd, new_parent, oldentry);
+		DirData moved(fs->fd, new_parent, renamed);
 
-		if(data.found){
+		if(moved.found){
 			ret = 0;
 		}
 		else{
@@ -1062,88 +5657,154 @@ int myrename(void* args, uint32_t old_parent, const char *old_name, uint32_t new
 	return ret;
 }
 
-int mytruncate(void* args, uint32_t block_num, off_t new_size){
+//what mytruncate does, fslock must be held
+static int truncateFile(void* args, uint32_t id, off_t new_size){
 	DBG("calling truncate");
+	ROCHECK
 	
 	struct Args *fs = (struct Args*)args;
-	inodeHead inode = readInode(fs->fd, INDEX(block_num));
+	uint32_t block_num = growInode(fs->fd, id, new_size);
+	inodeHead inode = readInode(fs->fd, INODEAT(block_num));
 	uint64_t extentHead = ((uint64_t)FEXTENT_NUM)|((uint64_t)block_num<<32);
-	int32_t qsize = new_size - (BLOCKSIZE-INODESIZE-BNUMSIZE);
+	uint32_t holeHead[3] = {HEXTENT_NUM, block_num, 0};
+	uint64_t capacity = BLOCKSIZE-INODESIZE-BNUMSIZE;
+	uint64_t extentSize = BLOCKSIZE-FILEEXTENTHEADSIZE-BNUMSIZE;
 	FileCursor cursor(block_num, INODESIZE);
-	uint32_t bnum;
-	uint32_t oldend;
-	uint32_t oldbcount = inode.blocks;
+	bool sparse = inode.flags & SPARSEFLAGS;
+	uint32_t oldflags = inode.flags;
+	uint32_t span;
+	uint32_t next;
+
+	if(block_num == 0){
+		return -ENOSPC;
+	}
+	if(PACKED(block_num)){
+		packResize(fs->fd, block_num, inode, new_size);
+		return 0;
+	}
+
+	//bytes between the old end of the file and the new one may be left over from a previous owner
+	if((uint64_t)new_size > inode.size){
+		zeroRange(fs->fd, block_num, inode.size, new_size, sparse);
+	}
 	
 	inode.blocks = 1;
 
-	while(qsize > 0){
+	//find the extent holding the last byte of the new size
+	while(capacity < (uint64_t)new_size){
 		
-		cursor.moveToExtent(fs->fd, FILEEXTENTHEADSIZE);
-		if(cursor.base == 0){
+		if(cursor.nextExtent(fs->fd, sparse) && cursor.base != 0){
+			inode.blocks++;
+		}
 
-			//get new extent block
-			if((bnum = ncache.getNewBlock(fs->fd, &extentHead, FILEEXTENTHEADSIZE, true)) != 0){
-				
-				//set new block at end of the chain
-				ncache.setNext(fs->fd, cursor.prev>>BLOCKSHIFT, bnum);
+		if(cursor.hole){
+			span = std::min((uint64_t)cursor.holeLeft, (new_size-capacity-1)/extentSize);
+			cursor.skipHole(span);
+			capacity += span*extentSize;
+		}
+		else if(cursor.base == 0 && (sext.features & HOLEFEATURE)){
 
-				//update cursor
-				oldend = cursor.base;
-				cursor = FileCursor(bnum, FILEEXTENTHEADSIZE);
-				cursor.prev = oldend;
+			//growth past the end of the chain is recorded as a single hole
+			holeHead[2] = (new_size-capacity+extentSize-1)/extentSize;
+			if(!appendExtent(fs->fd, cursor, holeHead, HOLEHEADSIZE, false)){
+				return -ENOSPC;
 			}
-			else{
-				//TODO proper return and stuff
-				exit(-1);
+			inode.blocks++;
+			inode.flags |= HOLEFLAG;
+			break;
+		}
+		else if(cursor.base == 0){
+
+			//images without holes get a zeroed extent for every one grown into
+			if(!appendExtent(fs->fd, cursor, &extentHead, FILEEXTENTHEADSIZE, true)){
+				return -ENOSPC;
 			}
+			inode.blocks++;
 		}
 
-		qsize -= BLOCKSIZE-FILEEXTENTHEADSIZE-BNUMSIZE;
-		inode.blocks++;
+		capacity += extentSize;
 	}
 
+	//a hole reaching past the new end is cut short
+	if(cursor.hole && cursor.holeLeft > 0){
+		span = cursor.holePos+1;
+		dwrite(fs->fd, &span, HOLESPANSIZE, cursor.base+FILEEXTENTHEADSIZE, "failed to shorten hole\n");
+	}
 
-	if(oldbcount > inode.blocks){
-		
-		cursor.moveToExtent(fs->fd, FILEEXTENTHEADSIZE);
-		ncache.setNext(fs->fd,cursor.prev>>BLOCKSHIFT, 0);
-		chainFree(fs->fd, cursor.base>>BLOCKSHIFT);
-
+	//everything after the extent holding the new end is released
+	if((next = ncache.getNext(fs->fd, cursor.base>>BLOCKSHIFT)) != 0){
+		ncache.setNext(fs->fd, cursor.base>>BLOCKSHIFT, 0);
+		chainFree(fs->fd, next);
 	}
 
-	dwrite(fs->fd, &(inode.blocks), ALLBLOCKSSIZE, INDEX(block_num)+ALLBLOCKSDEX, "truncation failed\n");
-	dwrite(fs->fd, &(new_size), SIZESIZE, INDEX(block_num)+SIZEDEX, "truncation of size failed\n");
+	inode.size = new_size;
+	if(inode.flags != oldflags){
+		dwrite(fs->fd, &(inode.flags), USERFLAGSSIZE, INDEX(block_num)+FLAGSDEX, "truncation of flags failed\n");
+	}
+	headWrite(fs->fd, INDEX(block_num), inode, SIZEDEX, INODESIZE, "truncation failed\n");
 
 
 	return 0;
 }
 
-int mywrite(void* args, uint32_t block_num, const char *buff, size_t wr_len, off_t wr_offset){
+int mytruncate(void* args, uint32_t id, off_t new_size){
+
+	FSLock lock;
+
+	return truncateFile(args, id, new_size);
+}
+
+//what mywrite does, fslock must be held
+static int writeFile(void* args, uint32_t id, const char *buff, size_t wr_len, off_t wr_offset){
 	
 	DBG("calling mywrite");
-	if(PDBG) fprintf(stderr, "--->wr_len %d, wr_offset %d\n", wr_len, wr_offset);
+	ROCHECK
+	if(PDBG) fprintf(stderr, "--->wr_len %d, wr_offset %d\n", (int)wr_len, (int)wr_offset);
 
 	struct Args *fs = (struct Args*)args;
+	uint32_t block_num = growInode(fs->fd, id, wr_offset+wr_len);
 	FileCursor cursor(block_num, INODESIZE);
 	uint32_t index = 0;
-	uint32_t bnum = 0;
 	uint64_t extentHead = ((uint64_t)FEXTENT_NUM)|((uint64_t)block_num<<32);
+	uint32_t holeHead[3] = {HEXTENT_NUM, block_num, 0};
 	int32_t delta = wr_len;
 	uint32_t metaSize = BLOCKSIZE - INODESIZE - BNUMSIZE;
-	inodeHead inode = readInode(fs->fd, INDEX(block_num));
-	uint32_t upsize = 0;
-	uint32_t oldend = 0;
+	inodeHead inode = readInode(fs->fd, INODEAT(block_num));
+	uint32_t oldflags = inode.flags;
+	uint64_t upsize = 0;
+	uint64_t skip;
+	bool fresh = false;
 
 	if(delta < 0){
 		//TODO error
 		exit(-2);
 	}
+	if(block_num == 0){
+		return -ENOSPC;
+	}
 
+	//a packed file keeps its data right behind its inode
+	if(PACKED(block_num)){
+		if((uint64_t)wr_offset > inode.size){
+			packResize(fs->fd, block_num, inode, wr_offset);
+		}
+		datawrite(fs->fd, buff, (ssize_t)wr_len, INODEAT(block_num)+INODESIZE+wr_offset, "failed to write packed data\n");
+		if(wr_offset+wr_len > inode.size){
+			inode.size = wr_offset+wr_len;
+			dwrite(fs->fd, &(inode.size), SIZESIZE, INODEAT(block_num)+SIZEDEX, "failed to update packed size\n");
+		}
+		return wr_len;
+	}
+
+	//bytes between the end of the file and the write may be left over from a previous owner
+	if((uint64_t)wr_offset > inode.size){
+		zeroRange(fs->fd, block_num, inode.size, wr_offset, inode.flags & SPARSEFLAGS);
+	}
 
-	while(wr_offset >= metaSize){
-		if(PDBG) fprintf(stderr, "skipping forward offset at %d\n", wr_offset);
+	while((uint64_t)wr_offset >= metaSize){
+		if(PDBG) fprintf(stderr, "skipping forward offset at %d\n", (int)wr_offset);
 		//move to next extent block
-		cursor.moveToExtent(fs->fd,FILEEXTENTHEADSIZE);
+		cursor.nextExtent(fs->fd, inode.flags & SPARSEFLAGS);
 		
 		//adjust offset relative to movement
 		wr_offset -= metaSize;
@@ -1154,28 +5815,36 @@ int mywrite(void* args, uint32_t block_num, const char *buff, size_t wr_len, off
 
 		metaSize = BLOCKSIZE - FILEEXTENTHEADSIZE - BNUMSIZE;
 
-		if(cursor.base == 0){
-
-			//get next extent block
-			if((bnum = ncache.getNewBlock(fs->fd, &extentHead, FILEEXTENTHEADSIZE, false)) != 0){
-				
-				//set new block at end of the chain
-				ncache.setNext(fs->fd, cursor.prev>>BLOCKSHIFT, bnum);
+		if(cursor.hole){
 
+			//jump over as much of the hole as the offset allows
+			skip = std::min((uint64_t)cursor.holeLeft, (uint64_t)wr_offset/metaSize);
+			cursor.skipHole(skip);
+			wr_offset -= skip*metaSize;
+			upsize += skip*metaSize;
+		}
+		else if(cursor.base == 0){
+
+			//every extent skipped past the end of the chain is covered by one hole
+			if((sext.features & HOLEFEATURE) && (holeHead[2] = wr_offset/metaSize) > 0){
+				if(!appendExtent(fs->fd, cursor, holeHead, HOLEHEADSIZE, false)){
+					return -ENOSPC;
+				}
+				wr_offset -= (uint64_t)holeHead[2]*metaSize;
+				upsize += (uint64_t)holeHead[2]*metaSize;
 				inode.blocks += 1;
+				inode.flags |= HOLEFLAG;
 
-				dwrite(fs->fd, &(inode.blocks), ALLBLOCKSSIZE, ALLBLOCKSDEX+INDEX(block_num), "failed to update size after writing");
-
-				//update cursor
-				oldend = cursor.base;
-				cursor = FileCursor(bnum, FILEEXTENTHEADSIZE);
-				cursor.prev = oldend;
+				cursor.prev = cursor.base;
+				cursor.base = 0;
 			}
-			else{
-				metaSize = 0;
-				delta = 0;
-				errno = ENOMEM;
+
+			//get next extent block, one the write skips over on an image without holes is zeroed
+			if(!appendExtent(fs->fd, cursor, &extentHead, FILEEXTENTHEADSIZE, wr_offset >= metaSize)){
+				return -ENOSPC;
 			}
+			inode.blocks += 1;
+			fresh = true;
 		}
 	}
 
@@ -1183,10 +5852,24 @@ int mywrite(void* args, uint32_t block_num, const char *buff, size_t wr_len, off
 	upsize += wr_offset;
 
 	while(delta > 0){
-		if(PDBG) fprintf(stderr, "writing data delta at %d meta alt = %d\n", delta, BLOCKSIZE + cursor.base - cursor.offset - BNUMSIZE);
+		if(PDBG) fprintf(stderr, "writing data delta at %d meta alt = %d\n", delta, (int)(BLOCKSIZE + cursor.base - cursor.offset - BNUMSIZE));
 		metaSize = std::min((int)(BLOCKSIZE + cursor.base - cursor.offset - BNUMSIZE), (int)delta);
 
-		dwrite(fs->fd, buff+index, metaSize, cursor.offset, "failed to write to file");
+		if(cursor.hole){
+			if(!splitHole(fs->fd, cursor, block_num, inode)){
+				errno = ENOMEM;
+				break;
+			}
+			fresh = true;
+		}
+
+		//blocks new to the chain are written whole so no stale bytes are left in them
+		if(fresh || ((inode.flags & UNWRITTENFLAG) && ncache.getKind(fs->fd, cursor.base>>BLOCKSHIFT) == FUEXTENT_NUM)){
+			fillExtent(fs->fd, cursor, block_num, buff+index, metaSize);
+		}
+		else{
+			datawrite(fs->fd, buff+index, metaSize, cursor.offset, "failed to write to file");
+		}
 
 		if(PDBG) fprintf(stderr, "finished writing\n");
 
@@ -1195,45 +5878,351 @@ int mywrite(void* args, uint32_t block_num, const char *buff, size_t wr_len, off
 		
 
 		if(delta>0) {
-			cursor.moveToExtent(fs->fd, FILEEXTENTHEADSIZE);
+			cursor.nextExtent(fs->fd, inode.flags & SPARSEFLAGS);
+			fresh = false;
+
+			if(cursor.base == 0){
+
+				//get next extent block
+				if(appendExtent(fs->fd, cursor, &extentHead, FILEEXTENTHEADSIZE, false)){
+					inode.blocks += 1;
+					fresh = true;
+				}
+				else{
+					delta = 0;
+					errno = ENOMEM;
+				}
+			}
 		}
+	}
 
+	if(PDBG) fprintf(stderr, "done with write loop, time to update inode size\n");
 
-		if(cursor.base == 0){
+	//size and block count sit next to each other in the inode and go out together
+	inode.size = std::max(upsize+index, inode.size);
+	if(inode.flags != oldflags){
+		dwrite(fs->fd, &(inode.flags), USERFLAGSSIZE, FLAGSDEX+INDEX(block_num), "failed to update flags after writing");
+	}
+	headWrite(fs->fd, INDEX(block_num), inode, SIZEDEX, INODESIZE, "failed to update size after writing");
 
-			//get next extent block
-			if((bnum = ncache.getNewBlock(fs->fd, &extentHead, FILEEXTENTHEADSIZE, false)) != 0){
-				
-				//set new block at end of the chain
-				ncache.setNext(fs->fd, cursor.prev >> BLOCKSHIFT, bnum);
+	if(PDBG) fprintf(stderr, "finished writing the size\n");
 
-				inode.blocks += 1;
+    return index;
+
+}
+
+int mywrite(void* args, uint32_t id, const char *buff, size_t wr_len, off_t wr_offset){
+
+	FSLock lock;
+
+	return writeFile(args, id, buff, wr_len, wr_offset);
+}
+
+int myfallocate(void* args, uint32_t id, int mode, off_t offset, off_t len){
+	DBG("calling fallocate");
+	ROCHECK
+
+	struct Args *fs = (struct Args*)args;
+	uint64_t end = (uint64_t)offset+len;
+	uint64_t firstSize = BLOCKSIZE - INODESIZE - BNUMSIZE;
+	uint64_t extentSize = BLOCKSIZE - FILEEXTENTHEADSIZE - BNUMSIZE;
+	uint64_t needed = end > firstSize ? (end - firstSize + extentSize - 1)/extentSize : 0;
+	uint64_t have = 0;
+	uint32_t kind = (sext.features & UNWRITTENFEATURE) ? FUEXTENT_NUM : FEXTENT_NUM;
+	uint64_t start;
+	uint64_t first;
+	uint64_t last;
+	uint32_t bnum;
+	uint32_t span;
+
+	if(mode & ~FALLOC_FL_KEEP_SIZE){
+		return -EOPNOTSUPP;
+	}
+	if(offset < 0 || len <= 0){
+		return -EINVAL;
+	}
+	if(offset > INT64_MAX - len){
+		return -EFBIG;
+	}
+
+	//a packed file is only moved out of its slot once the range is known to be good
+	FSLock lock;
+	uint32_t block_num = growInode(fs->fd, id, end);
+	if(block_num == 0){
+		return -ENOSPC;
+	}
+	inodeHead inode = readInode(fs->fd, INODEAT(block_num));
+	FileCursor cursor(block_num, INODESIZE);
+	uint32_t oldflags = inode.flags;
+
+	//a slot is all the space a packed file can have
+	if(PACKED(block_num)){
+		if(!(mode & FALLOC_FL_KEEP_SIZE) && end > inode.size){
+			packResize(fs->fd, block_num, inode, end);
+		}
+		return 0;
+	}
 
-				dwrite(fs->fd, &(inode.blocks), ALLBLOCKSSIZE, ALLBLOCKSDEX+INDEX(block_num), "failed to update size after writing");
+	//only unwritten extents may lie past the end of a file
+	if((mode & FALLOC_FL_KEEP_SIZE) && kind != FUEXTENT_NUM && end > inode.size){
+		return -EOPNOTSUPP;
+	}
 
-				//update cursor
-				oldend = cursor.base;
-				cursor = FileCursor(bnum, FILEEXTENTHEADSIZE);
-				cursor.prev = oldend;
+	//walk to the tail of the chain, counting the extents already there and
+	//backing any hole that overlaps the range with reserved blocks
+	cursor.nextExtent(fs->fd, inode.flags & SPARSEFLAGS);
+	while(cursor.base != 0){
+
+		if(cursor.hole){
+			start = firstSize + have*extentSize;
+			span = cursor.holeLeft+1;
+
+			//only the extents of the hole that overlap the range are backed
+			first = (uint64_t)offset > start ? ((uint64_t)offset-start)/extentSize : 0;
+			last = end > start ? std::min((uint64_t)span, (end-start+extentSize-1)/extentSize) : 0;
+
+			if(first < last){
+				if(!fillHole(fs->fd, cursor, block_num, inode, first, last-first)){
+					return -ENOSPC;
+				}
+				inode.flags |= UNWRITTENFLAG;
+				have += last;
 			}
 			else{
-				delta = 0;
-				errno = ENOMEM;
+				cursor.skipHole(cursor.holeLeft);
+				have += span;
 			}
 		}
+		else{
+			have++;
+		}
+		cursor.nextExtent(fs->fd, inode.flags & SPARSEFLAGS);
 	}
 
-	if(PDBG) fprintf(stderr, "done with write loop, time to update inode size\n");
+	if(needed > have){
 
-	inode.size = std::max((int)(upsize+index),(int)(inode.size));
-	dwrite(fs->fd, &(inode.size), SIZESIZE, SIZEDEX+INDEX(block_num), "failed to update size after writing");
+		//reserve the missing extents in one allocation and hang them off the tail,
+		//images without unwritten extents get regular ones that are already zero
+		if((bnum = ncache.getNewRun(fs->fd, needed-have, block_num, kind)) == 0){
+			return -ENOSPC;
+		}
+		ncache.setNext(fs->fd, cursor.prev>>BLOCKSHIFT, bnum);
 
-	if(PDBG) fprintf(stderr, "finished writing the size\n");
+		inode.blocks += needed-have;
+		if(kind == FUEXTENT_NUM){
+			inode.flags |= UNWRITTENFLAG;
+		}
+	}
 
-    return index;
+	if(!(mode & FALLOC_FL_KEEP_SIZE) && end > inode.size){
+
+		//bytes between the old size and the new one may be left over from a previous owner
+		zeroRange(fs->fd, block_num, inode.size, end, inode.flags & SPARSEFLAGS);
+		inode.size = end;
+	}
+
+	if(inode.flags != oldflags){
+		dwrite(fs->fd, &(inode.flags), USERFLAGSSIZE, INDEX(block_num)+FLAGSDEX, "failed to mark file as preallocated\n");
+	}
+	headWrite(fs->fd, INDEX(block_num), inode, SIZEDEX, INODESIZE, "failed to update size after preallocating\n");
+
+	return 0;
+}
+
+/*
+	finds the next data or hole boundary at or after offset, for SEEK_DATA and
+	SEEK_HOLE. unwritten extents count as holes, as does the end of the file
+*/
+static off_t seekFile(void* args, uint32_t id, off_t offset, int whence){
+	DBG("calling lseek");
+
+	struct Args *fs = (struct Args*)args;
+	uint32_t block_num = resolveInode(fs->fd, id);
+	inodeHead inode = readInode(fs->fd, INODEAT(block_num));
+	FileCursor cursor(block_num, INODESIZE);
+	uint64_t start = 0;
+	uint64_t span = BLOCKSIZE - INODESIZE - BNUMSIZE;
+	bool empty;
+
+	if(whence != SEEK_DATA && whence != SEEK_HOLE){
+		return -EINVAL;
+	}
+	if(offset < 0 || (uint64_t)offset >= inode.size){
+		return -ENXIO;
+	}
+	if(!(inode.flags & SPARSEFLAGS)){
+		return whence == SEEK_DATA ? offset : inode.size;
+	}
+
+	while(cursor.base != 0 && start < inode.size){
+
+		empty = cursor.hole || ncache.getKind(fs->fd, cursor.base>>BLOCKSHIFT) == FUEXTENT_NUM;
+		if(cursor.hole){
+			span += (uint64_t)cursor.holeLeft*(BLOCKSIZE - FILEEXTENTHEADSIZE - BNUMSIZE);
+			cursor.skipHole(cursor.holeLeft);
+		}
+
+		if(start + span > (uint64_t)offset && empty == (whence == SEEK_HOLE)){
+			return std::max(start, (uint64_t)offset);
+		}
+
+		start += span;
+		span = BLOCKSIZE - FILEEXTENTHEADSIZE - BNUMSIZE;
+		cursor.nextExtent(fs->fd, true);
+	}
+
+	return whence == SEEK_DATA ? -ENXIO : inode.size;
+}
+
+off_t mylseek(void* args, uint32_t id, off_t offset, int whence){
+
+	FSLock lock;
+
+	return seekFile(args, id, offset, whence);
+}
+
+/*
+	the journal and the image are shared by every file, so syncing one file
+	or directory syncs them all. what is held back for a single inode is
+	only its times, they go out for the file synced and not for a datasync,
+	which doesn't need them to find the data again
+*/
+int myfsync(void* args, uint32_t id, int datasync){
+	DBG("calling fsync");
+
+	struct Args *fs = (struct Args*)args;
+	struct timespec start;
+	struct timespec end;
+	int res = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(!datasync && fs->syncMode != SYNCFAST){
+		FSLock lock;
+		lazySync(fs->fd, INODEAT(resolveInode(fs->fd, id)));
+	}
+
+	if(fs->syncMode == SYNCSTRICT){
+		res = syncImage(fs->fd);
+	}
+	else if(fs->syncMode == SYNCBATCH){
+		res = groupSync(fs->fd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_mutex_lock(&syncLock);
+	syncCalls++;
+	if(fs->syncMode == SYNCFAST){
+		syncSkipped++;
+	}
+	syncWaitNs += (end.tv_sec-start.tv_sec)*1000000000LL + end.tv_nsec-start.tv_nsec;
+	pthread_mutex_unlock(&syncLock);
+
+	return res;
+}
+
+/*
+	called on every close. nothing is held back in memory except by the
+	journal, and close promises no durability, so this only counts
+*/
+int myflush(void* args, uint32_t id){
+	DBG("calling flush");
 
+	pthread_mutex_lock(&syncLock);
+	syncFlushes++;
+	pthread_mutex_unlock(&syncLock);
+
+	return 0;
 }
 
+/*
+	copies between files inside the daemon, a large chunk per pass, instead
+	of every byte going out to the caller and back. holes of the source that
+	land past the end of the destination are skipped and stay holes. the
+	blocks themselves aren't shared, nothing counts how many files use one.
+	the FUSE bridge for it is compiled out under libfuse 2.x, so mounts
+	never call it and only callers of the ops table do
+*/
+ssize_t mycopy(void* args, uint32_t src, off_t src_offset, uint32_t dst, off_t dst_offset, size_t len, int flags){
+	DBG("calling copy_file_range");
+	ROCHECK
+
+	struct Args *fs = (struct Args*)args;
+	uint64_t srcSize;
+	uint64_t dstSize;
+	uint64_t copied = 0;
+	uint64_t chunk;
+	uint8_t* buff;
+	off_t data;
+	off_t hole;
+	int got;
+	int res;
+
+	if(flags != 0 || src_offset < 0 || dst_offset < 0){
+		return -EINVAL;
+	}
+
+	{
+		FSLock lock;
+		uint32_t from = resolveInode(fs->fd, src);
+		uint32_t to = resolveInode(fs->fd, dst);
+
+		srcSize = readInode(fs->fd, INODEAT(from)).size;
+		dstSize = readInode(fs->fd, INODEAT(to)).size;
+		len = (uint64_t)src_offset < srcSize ? std::min((uint64_t)len, srcSize-src_offset) : 0;
+
+		//the chunks would read back what they just wrote
+		if(from == to && (uint64_t)src_offset < (uint64_t)dst_offset+len && (uint64_t)dst_offset < (uint64_t)src_offset+len){
+			return -EINVAL;
+		}
+	}
+
+	if(len == 0){
+		return 0;
+	}
+	if((buff = (uint8_t*)malloc(std::min((size_t)COPYCHUNK, len))) == NULL){
+		return -ENOMEM;
+	}
+
+	//the lock is taken a chunk at a time, the destination may have changed size in between
+	while(copied < len){
+		FSLock lock;
+
+		chunk = std::min((uint64_t)COPYCHUNK, len-copied);
+		dstSize = readInode(fs->fd, INODEAT(resolveInode(fs->fd, dst))).size;
+
+		//past the end of the destination only data is written, a hole is left for a hole
+		if(dst_offset+copied >= dstSize){
+			if((data = seekFile(args, src, src_offset+copied, SEEK_DATA)) != (off_t)(src_offset+copied)){
+				copied = data < 0 ? len : std::min((uint64_t)(data-src_offset), (uint64_t)len);
+				continue;
+			}
+			if((hole = seekFile(args, src, src_offset+copied, SEEK_HOLE)) > data){
+				chunk = std::min(chunk, (uint64_t)(hole-data));
+			}
+		}
+
+		if((got = readFile(args, src, (char*)buff, chunk, src_offset+copied)) <= 0){
+			break;
+		}
+		if((res = writeFile(args, dst, (const char*)buff, got, dst_offset+copied)) <= 0){
+			free(buff);
+			return copied != 0 || res == 0 ? (ssize_t)copied : res;
+		}
+		copied += res;
+	}
+	free(buff);
+
+	//a hole at the end still counts towards the size
+	{
+		FSLock lock;
+
+		dstSize = readInode(fs->fd, INODEAT(resolveInode(fs->fd, dst))).size;
+		if(dst_offset+copied > dstSize && (res = truncateFile(args, dst, dst_offset+copied)) < 0){
+			return res;
+		}
+	}
+	return copied;
+}
 
 
 #ifdef  __cplusplus
@@ -1243,17 +6232,18 @@ extern "C" {
 struct cpe453fs_ops *CPE453_get_operations(void)
 {
 	static struct cpe453fs_ops ops;
-	static struct Args args;
 	memset(&ops, 0, sizeof(ops));
-	ops.arg = &args;
+	ops.arg = &fsargs;
 
 	ops.getattr = mygetattr;
 	ops.readdir = myreaddir;
+	ops.lookup = mylookup;
 	ops.open = myopen;
 	ops.read = myread;
 	ops.readlink = myreadlink;
 	ops.root_node = root_node;
 	ops.set_file_descriptor = set_file_descriptor;
+	ops.mount_option = mount_option;
 
 	ops.chmod = mychmod;
 	ops.chown = mychown;
@@ -1268,6 +6258,15 @@ struct cpe453fs_ops *CPE453_get_operations(void)
 	ops.truncate = mytruncate;
 	ops.write = mywrite;
 
+	ops.init = myinit;
+	ops.destroy = mydestroy;
+	ops.fallocate = myfallocate;
+	ops.lseek = mylseek;
+	ops.fsync = myfsync;
+	ops.flush = myflush;
+	ops.copy_file_range = mycopy;
+	ops.stats = mystats;
+
 	return &ops;
 }
 
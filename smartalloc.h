@@ -83,7 +83,11 @@ inline void operator delete(void *p) throw() { smartfree(p, __FILE__, __LINE__);
 inline void operator delete[](void *p) throw() { smartfree(p, __FILE__, __LINE__); }
 inline void *operator new(size_t size, const std::nothrow_t&t, char *file, int line, char pat) { return smartalloc(size, file, line, pat); }
 inline void *operator new[](size_t size, const std::nothrow_t&t, char *file, int line, char pat) { return smartalloc(size, file, line, pat); }
+#if __cplusplus >= 201103L
+inline void *operator new(size_t size) { return smartalloc(size, __FILE__, __LINE__, 0x54); }
+#else
 inline void *operator new(size_t size) throw (std::bad_alloc) { return smartalloc(size, __FILE__, __LINE__, 0x54); }
+#endif
 
 inline void *operator new(size_t size, const std::nothrow_t&t) throw() { return smartalloc(size, __FILE__, __LINE__, 0x54); }
 inline void *operator new[](size_t size, const std::nothrow_t&t) throw() { return smartalloc(size, __FILE__, __LINE__, 0x54); }